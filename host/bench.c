@@ -0,0 +1,1466 @@
+/*
+ * Micro-benchmarks for host build of stkboot.
+ * Scripted STK500 sessions are fed through the mocked UART,
+ * and the time per frame and per byte is reported, with no delays
+ * of flash and UART. Then every session is run once more with
+ * the hardware timing, and answers, flash contents and the use
+ * of hardware are checked. CRC throughput is measured directly.
+ *
+ * Options set the timing, in polls of registers:
+ *	-s polls	page erase or write
+ *	-e polls	EEPROM byte write
+ *	-b polls	UART byte
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../stk500.h"
+#include "mock.h"
+
+#define PAGE		HOST_PAGE_BYTES
+#define NPAGES		(BADDR / PAGE)
+#define ROUNDS		20
+
+#ifndef EXT_PAGES
+#define EXT_PAGES	4	/* the same default as in stkboot.c */
+#endif
+#if defined INCREMENTAL && ! defined LAZY_ERASE
+#define LAZY_ERASE	/* implied, as in stkboot.c */
+#endif
+#if defined STAGING && ! defined FLASH_API
+#define FLASH_API
+#endif
+#ifdef STAGING
+#ifndef STAGE_ADDR
+#define STAGE_ADDR	((BADDR - PAGE) / 2 & ~(PAGE - 1UL))
+#endif
+#define STAGE_INFO	(BADDR - PAGE)
+#endif
+#define TOKEN_EXT	(TOKEN | 0x80)
+
+/* Nonstandard commands and status, as in stkboot.c */
+#define CMD_UPDATE_FLASH_ISP	(CMD_PROGRAM_FLASH_ISP | 0x80)
+#define CMD_CRC_FLASH_ISP	(CMD_READ_FLASH_ISP | 0x40)
+#define CMD_PROGRAM_PACKED_ISP	(CMD_PROGRAM_FLASH_ISP | 0x40)
+#define CMD_FILL_FLASH_ISP	(CMD_PROGRAM_FLASH_ISP | 0xC0)
+#define STATUS_VERIFY_FAILED	0xC2
+
+#ifdef RS485
+#define NODE		0x21	/* address of the node under test */
+#define HDR		6	/* header with node address */
+#else
+#define HDR		5
+#endif
+
+struct script {
+	unsigned char *data;
+	size_t len, size;
+	struct host_chunk *chunk;
+	unsigned nchunks, chunk_size;
+	size_t chunked;			/* bytes in chunks */
+	unsigned nframes;
+	unsigned char seqnum;
+	unsigned char *reply;		/* expected answers: length, body */
+	size_t reply_len, reply_size;
+	unsigned nreplies;
+#ifdef RS485
+	unsigned char broadcast;	/* frames to all nodes */
+#endif
+};
+
+static unsigned char image [BADDR];
+static int errors;
+static unsigned long spm_polls = HOST_SPM_POLLS;
+static unsigned long ee_polls = HOST_EE_POLLS;
+static unsigned long byte_polls = HOST_BYTE_POLLS;
+
+static double now ()
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void put_byte (struct script *s, unsigned char c)
+{
+	if (s->len >= s->size) {
+		s->size = s->size ? s->size * 2 : 65536;
+		s->data = realloc (s->data, s->size);
+		if (! s->data)
+			abort ();
+	}
+	s->data [s->len++] = c;
+}
+
+/*
+ * Bytes since the previous chunk are sent at once,
+ * then the host waits for answers.
+ */
+static void put_chunk (struct script *s, unsigned answers)
+{
+	if (s->nchunks >= s->chunk_size) {
+		s->chunk_size = s->chunk_size ? s->chunk_size * 2 : 1024;
+		s->chunk = realloc (s->chunk, s->chunk_size * sizeof (*s->chunk));
+		if (! s->chunk)
+			abort ();
+	}
+	memset (&s->chunk [s->nchunks], 0, sizeof (*s->chunk));
+	s->chunk [s->nchunks].len = s->len - s->chunked;
+	s->chunk [s->nchunks].answers = answers;
+	s->nchunks++;
+	s->chunked = s->len;
+}
+
+/*
+ * Append a frame, with correct or broken checksum.
+ */
+static void put_frame (struct script *s, const unsigned char *body,
+	unsigned len, int good)
+{
+	unsigned char hdr [HDR], cksum = 0;
+	unsigned i, n = 0;
+
+	hdr[n++] = MESSAGE_START;
+#ifdef RS485
+	hdr[n++] = s->broadcast ? 0 : NODE;
+#endif
+	hdr[n++] = s->seqnum++;
+	hdr[n++] = len >> 8;
+	hdr[n++] = len;
+	hdr[n++] = TOKEN;
+	for (i=0; i<n; ++i) {
+		put_byte (s, hdr[i]);
+		cksum ^= hdr[i];
+	}
+	for (i=0; i<len; ++i) {
+		put_byte (s, body[i]);
+		cksum ^= body[i];
+	}
+	put_byte (s, good ? cksum : ~cksum);
+	s->nframes++;
+#ifdef RS485
+	put_chunk (s, ! s->broadcast);
+#else
+	put_chunk (s, 1);
+#endif
+}
+
+#ifdef EXT_FRAME
+/*
+ * Append an extended frame, with CRC-16.
+ */
+static void put_ext_frame (struct script *s, const unsigned char *body,
+	unsigned len, int good)
+{
+	unsigned char hdr [HDR];
+	unsigned short sum = 0;
+	unsigned i, n = 0;
+
+	hdr[n++] = MESSAGE_START;
+#ifdef RS485
+	hdr[n++] = s->broadcast ? 0 : NODE;
+#endif
+	hdr[n++] = s->seqnum++;
+	hdr[n++] = len >> 8;
+	hdr[n++] = len;
+	hdr[n++] = TOKEN_EXT;
+	for (i=0; i<n; ++i) {
+		put_byte (s, hdr[i]);
+		sum = crc16 (sum, hdr[i]);
+	}
+	for (i=0; i<len; ++i) {
+		put_byte (s, body[i]);
+		sum = crc16 (sum, body[i]);
+	}
+	if (! good)
+		sum = ~sum;
+	put_byte (s, sum >> 8);
+	put_byte (s, sum);
+	s->nframes++;
+#ifdef RS485
+	put_chunk (s, ! s->broadcast);
+#else
+	put_chunk (s, 1);
+#endif
+}
+#endif
+
+/*
+ * After reset, the host waits until the sign-on message
+ * is sent: the receiver is not read meanwhile.
+ */
+static void put_reset (struct script *s)
+{
+	put_chunk (s, 0);
+	s->chunk [s->nchunks - 1].delay = 8 * byte_polls;
+}
+
+static void put_cmd (struct script *s, unsigned char c0, unsigned char c1,
+	unsigned char c2)
+{
+	unsigned char body [3] = { c0, c1, c2 };
+
+	put_frame (s, body, 3, 1);
+}
+
+/*
+ * Expected answer to the last frame. With no body,
+ * only the status is checked.
+ */
+static void put_reply (struct script *s, const unsigned char *body,
+	unsigned len)
+{
+	if (s->reply_len + 2 + len > s->reply_size) {
+		s->reply_size = s->reply_size ? s->reply_size * 2 : 65536;
+		s->reply = realloc (s->reply, s->reply_size);
+		if (! s->reply)
+			abort ();
+	}
+	s->reply [s->reply_len++] = len >> 8;
+	s->reply [s->reply_len++] = len;
+	memcpy (s->reply + s->reply_len, body, len);
+	s->reply_len += len;
+	s->nreplies++;
+}
+
+static void put_reply_status (struct script *s, unsigned char cmd,
+	unsigned char status)
+{
+	unsigned char body [2] = { cmd, status };
+
+	put_reply (s, body, 2);
+}
+
+static void put_load_address (struct script *s, unsigned long addr)
+{
+	unsigned char body [5];
+
+	addr >>= 1;
+	body[0] = CMD_LOAD_ADDRESS;
+	body[1] = addr >> 24;
+	body[2] = addr >> 16;
+	body[3] = addr >> 8;
+	body[4] = addr;
+	put_frame (s, body, 5, 1);
+}
+
+static void put_read (struct script *s, unsigned char cmd, unsigned n)
+{
+	unsigned char body [4] = { cmd, n >> 8, n, 0x20 };
+
+	put_frame (s, body, 4, 1);
+}
+
+/*
+ * Program data at address with given command: a page or its part.
+ */
+static void put_program (struct script *s, unsigned char cmd,
+	unsigned long addr, const unsigned char *data, unsigned n)
+{
+	unsigned char body [10 + PAGE];
+
+	put_load_address (s, addr);
+	put_reply_status (s, CMD_LOAD_ADDRESS, STATUS_CMD_OK);
+	body[0] = cmd;
+	body[1] = n >> 8;
+	body[2] = n;
+	memset (body + 3, 0, 7);
+	memcpy (body + 10, data, n);
+	put_frame (s, body, 10 + n, 1);
+}
+
+/*
+ * Read a page, which is expected to have given contents.
+ */
+static void put_read_page (struct script *s, unsigned long addr,
+	const unsigned char *data)
+{
+	unsigned char reply [3 + PAGE];
+
+	put_load_address (s, addr);
+	put_reply_status (s, CMD_LOAD_ADDRESS, STATUS_CMD_OK);
+	put_read (s, CMD_READ_FLASH_ISP, PAGE);
+	reply[0] = CMD_READ_FLASH_ISP;
+	reply[1] = STATUS_CMD_OK;
+	memcpy (reply + 2, data, PAGE);
+	reply[2 + PAGE] = STATUS_CMD_OK;
+	put_reply (s, reply, 3 + PAGE);
+}
+
+/*
+ * Sign on and enter programming mode.
+ */
+static void put_enter (struct script *s)
+{
+	put_reset (s);
+	put_cmd (s, CMD_SIGN_ON, 0, 0);
+	put_reply (s, 0, 0);
+	put_cmd (s, CMD_ENTER_PROGMODE_ISP, 0, 0);
+	put_reply_status (s, CMD_ENTER_PROGMODE_ISP, STATUS_CMD_OK);
+}
+
+/*
+ * Chip erase: with BLANK_CHECK, the answer has the number
+ * of pages erased.
+ */
+static void put_erase (struct script *s, unsigned count)
+{
+	unsigned char reply [4] = { CMD_CHIP_ERASE_ISP, STATUS_CMD_OK,
+		count >> 8, count };
+
+	put_cmd (s, CMD_CHIP_ERASE_ISP, 0, 0);
+#if defined BLANK_CHECK && ! defined LAZY_ERASE
+	put_reply (s, reply, 4);
+#else
+	put_reply (s, reply, 2);
+#endif
+}
+
+/*
+ * Leave programming mode: with LEAVE_START, the answer
+ * tells whether the application is started.
+ */
+static void put_leave (struct script *s, int app)
+{
+	unsigned char reply [3] = { CMD_LEAVE_PROGMODE_ISP, STATUS_CMD_OK,
+		app };
+
+	put_cmd (s, CMD_LEAVE_PROGMODE_ISP, 1, 1);
+#ifdef LEAVE_START
+	put_reply (s, reply, 3);
+#else
+	put_reply (s, reply, 2);
+#endif
+}
+
+/*
+ * Walk through answer frames in host_output. Check framing
+ * and status, call a function for every answer body.
+ */
+static unsigned check_answers (const char *name,
+	void (*func) (unsigned n, const unsigned char *body, unsigned len))
+{
+	const unsigned char *p = host_output, *end = p + host_output_len;
+	unsigned n = 0, len, i;
+	unsigned char cksum;
+
+	/* Skip sign-on message */
+	while (p < end && *p != MESSAGE_START)
+		p++;
+	while (p + HDR + 1 <= end) {
+		len = p[HDR-3] << 8 | p[HDR-2];
+#ifdef RS485
+		if (p[1] != NODE) {
+			printf ("%s: answer from wrong node\n", name);
+			errors++;
+		}
+#endif
+#ifdef EXT_FRAME
+		if (p[0] == MESSAGE_START && p[HDR-1] == TOKEN_EXT &&
+		    p + HDR + 2 + len <= end) {
+			unsigned short sum = 0;
+
+			for (i=0; i<len+HDR; ++i)
+				sum = crc16 (sum, p[i]);
+			if (sum != (p[len+HDR] << 8 | p[len+HDR+1])) {
+				printf ("%s: bad answer CRC\n", name);
+				errors++;
+			}
+			if (func)
+				func (n, p + HDR, len);
+			n++;
+			p += len + HDR + 2;
+			continue;
+		}
+#endif
+		if (p[0] != MESSAGE_START || p[HDR-1] != TOKEN ||
+		    p + HDR + 1 + len > end) {
+			printf ("%s: bad answer frame\n", name);
+			errors++;
+			return n;
+		}
+		cksum = 0;
+		for (i=0; i<len+HDR; ++i)
+			cksum ^= p[i];
+		if (cksum != p[len+HDR]) {
+			printf ("%s: bad answer checksum\n", name);
+			errors++;
+		}
+		if (func)
+			func (n, p + HDR, len);
+		n++;
+		p += len + HDR + 1;
+	}
+	return n;
+}
+
+static void expect_ok (unsigned n, const unsigned char *body, unsigned len)
+{
+	if (len < 2 || body[1] != STATUS_CMD_OK) {
+		printf ("answer %u: command 0x%02x failed\n", n, body[0]);
+		errors++;
+	}
+}
+
+static unsigned long read_page;
+
+/*
+ * Answers to LOAD_ADDRESS + READ_FLASH pairs.
+ */
+static void expect_data (unsigned n, const unsigned char *body, unsigned len)
+{
+	expect_ok (n, body, len);
+	if (body[0] != CMD_READ_FLASH_ISP)
+		return;
+	if (len != PAGE + 3 ||
+	    memcmp (body + 2, image + read_page * PAGE, PAGE) != 0) {
+		printf ("readback: page %lu differs\n", read_page);
+		errors++;
+	}
+	read_page++;
+}
+
+static void expect_crc (unsigned n, const unsigned char *body, unsigned len)
+{
+	unsigned short sum = 0;
+	unsigned i;
+
+	expect_ok (n, body, len);
+	if (body[0] != (CMD_READ_FLASH_ISP | 0x80))
+		return;
+	for (i=0; i<PAGE; ++i)
+		sum = crc16 (sum, image [read_page * PAGE + i]);
+	if (len != 4 || (body[2] << 8 | body[3]) != sum) {
+		printf ("checksum: page %lu differs\n", read_page);
+		errors++;
+	}
+	read_page++;
+}
+
+static void expect_cksum_error (unsigned n, const unsigned char *body,
+	unsigned len)
+{
+	if (len != 2 || body[0] != ANSWER_CKSUM_ERROR) {
+		printf ("answer %u: checksum error expected\n", n);
+		errors++;
+	}
+}
+
+#ifdef RS485
+/*
+ * Answers to polling after broadcast programming:
+ * node status, number of broadcast frames since chip erase
+ * (including it), leave.
+ */
+static void expect_node (unsigned n, const unsigned char *body, unsigned len)
+{
+	expect_ok (n, body, len);
+	if (n == 0 && (len != 3 || body[2] != STATUS_CMD_OK)) {
+		printf ("program-bcast: node status 0x%02x\n", body[2]);
+		errors++;
+	}
+	if (n == 1 && (len != 3 || body[2] != (unsigned char) (2*NPAGES + 1))) {
+		printf ("program-bcast: %u broadcast frames\n", body[2]);
+		errors++;
+	}
+}
+#endif
+
+/*
+ * Hardware timing for the checks, or no delays for the benchmark.
+ */
+static void set_timing (int on)
+{
+	host_spm_polls = on ? spm_polls : 0;
+	host_ee_polls = on ? ee_polls : 0;
+	host_byte_polls = on ? byte_polls : 0;
+}
+
+/*
+ * Misuse of hardware, lost bytes and missing answers.
+ */
+static void check_hardware (const char *name)
+{
+	if (host_stats.busy_errors) {
+		printf ("%s: %lu accesses to busy flash or EEPROM\n",
+			name, host_stats.busy_errors);
+		errors++;
+	}
+	if (host_stats.rww_errors) {
+		printf ("%s: %lu reads of busy RWW section\n",
+			name, host_stats.rww_errors);
+		errors++;
+	}
+	if (host_stats.rx_lost || host_stats.tx_lost ||
+	    host_stats.garbled) {
+		printf ("%s: bytes lost %lu received, %lu sent, %lu garbled\n",
+			name, host_stats.rx_lost, host_stats.tx_lost,
+			host_stats.garbled);
+		errors++;
+	}
+	if (host_stats.timeouts) {
+		printf ("%s: %lu answers timed out\n",
+			name, host_stats.timeouts);
+		errors++;
+	}
+}
+
+/*
+ * Run the script ROUNDS times and report the time of frames
+ * following the first skip bytes. The time of the prefix
+ * is given in base. Then run it with hardware timing,
+ * for the checks.
+ */
+static double run (const char *name, struct script *s, size_t skip,
+	unsigned skip_frames, double base)
+{
+	double t0, sec;
+	int i;
+
+	set_timing (0);
+	t0 = now ();
+	for (i=0; i<ROUNDS; ++i)
+		host_run (s->data, s->chunk, s->nchunks, 1);
+	sec = now () - t0;
+	printf ("%-12s %8u %10zu %12.0f %10.2f\n", name,
+		(s->nframes - skip_frames) * ROUNDS,
+		(s->len - skip) * ROUNDS,
+		(s->nframes - skip_frames) * ROUNDS / (sec - base),
+		(sec - base) * 1e9 / ((s->len - skip) * ROUNDS));
+
+	set_timing (1);
+	memset (&host_stats, 0, sizeof (host_stats));
+	host_run (s->data, s->chunk, s->nchunks, 1);
+	check_hardware (name);
+	return sec;
+}
+
+static const char *reply_name;
+static const unsigned char *reply_next;
+
+/*
+ * Compare the answer with the expected one.
+ */
+static void expect_reply (unsigned n, const unsigned char *body, unsigned len)
+{
+	unsigned want = reply_next[0] << 8 | reply_next[1];
+
+	if (want == 0) {
+		if (len < 2 || body[1] != STATUS_CMD_OK) {
+			printf ("%s: answer %u, command 0x%02x failed\n",
+				reply_name, n, body[0]);
+			errors++;
+		}
+	} else if (len != want || memcmp (body, reply_next + 2, len) != 0) {
+		printf ("%s: answer %u, command 0x%02x, status 0x%02x differs\n",
+			reply_name, n, body[0], len > 1 ? body[1] : 0);
+		errors++;
+	}
+	reply_next += 2 + want;
+}
+
+/*
+ * Run the script of a check once, with hardware timing,
+ * and compare the answers with the expected ones.
+ */
+static void run_check (const char *name, struct script *s, int warmboot)
+{
+	unsigned n;
+
+	set_timing (1);
+	memset (&host_stats, 0, sizeof (host_stats));
+	host_run (s->data, s->chunk, s->nchunks, warmboot);
+	check_hardware (name);
+
+	reply_name = name;
+	reply_next = s->reply;
+	n = check_answers (name, s->nreplies ? expect_reply : 0);
+	if (n != s->nreplies) {
+		printf ("%s: %u answers, %u expected\n", name, n, s->nreplies);
+		errors++;
+	}
+}
+
+/*
+ * Compare a range of flash with the data.
+ */
+static void expect_flash (const char *name, unsigned long addr,
+	const unsigned char *data, unsigned long n)
+{
+	unsigned long i;
+
+	for (i=0; i<n; ++i) {
+		if (host_flash [addr + i] != data[i]) {
+			printf ("%s: flash differs at 0x%lx\n", name, addr + i);
+			errors++;
+			return;
+		}
+	}
+}
+
+static void expect_empty (const char *name, unsigned long addr,
+	unsigned long n)
+{
+	static unsigned char empty [PAGE];
+	unsigned long i;
+
+	memset (empty, 0xFF, PAGE);
+	for (i=0; i<n; i+=PAGE)
+		expect_flash (name, addr + i, empty, n - i < PAGE ? n - i : PAGE);
+}
+
+static void expect_count (const char *name, const char *what,
+	unsigned long count, unsigned long want)
+{
+	if (count != want) {
+		printf ("%s: %lu %s, %lu expected\n", name, count, what, want);
+		errors++;
+	}
+}
+
+/*
+ * Over an old image: chip erase twice, read an odd page, program
+ * even pages and leave. Odd pages are left empty: with LAZY_ERASE,
+ * they are read as empty and erased on leaving. With BLANK_CHECK,
+ * empty pages are not erased again.
+ */
+static void check_erase ()
+{
+	struct script s = {0};
+	unsigned char empty [PAGE];
+	unsigned long page;
+
+	memcpy (host_flash, image, BADDR);
+	memset (empty, 0xFF, PAGE);
+	put_enter (&s);
+	put_erase (&s, NPAGES);
+	put_erase (&s, 0);
+	put_read_page (&s, PAGE, empty);
+	for (page=0; page<NPAGES; page+=2) {
+		put_program (&s, CMD_PROGRAM_FLASH_ISP, page * PAGE,
+			image + page * PAGE, PAGE);
+		put_reply_status (&s, CMD_PROGRAM_FLASH_ISP, STATUS_CMD_OK);
+	}
+	put_leave (&s, 1);
+	run_check ("erase", &s, 1);
+
+	for (page=0; page<NPAGES; ++page) {
+		if (page & 1)
+			expect_empty ("erase", page * PAGE, PAGE);
+		else
+			expect_flash ("erase", page * PAGE,
+				image + page * PAGE, PAGE);
+	}
+#if defined LAZY_ERASE
+	/* Page 0 by both chip erases, the rest once */
+	expect_count ("erase", "page erases", host_stats.erases, NPAGES + 1);
+#elif defined BLANK_CHECK
+	expect_count ("erase", "page erases", host_stats.erases, NPAGES);
+#else
+	expect_count ("erase", "page erases", host_stats.erases, 2 * NPAGES);
+#endif
+}
+
+/*
+ * A frame with bad checksum, then the good one to the same page:
+ * data of the broken frame, streamed into the page buffer
+ * with STREAM_FILL, must not get into flash. Page 0 is not
+ * streamed, page 3 is.
+ */
+static void check_rejected ()
+{
+	struct script s = {0};
+	unsigned char body [10 + EXT_PAGES * PAGE];
+	unsigned char reply [2] = { ANSWER_CKSUM_ERROR, STATUS_CKSUM_ERROR };
+	unsigned long page, i;
+	static const unsigned long pages [2] = { 0, 3 };
+
+	memset (host_flash, 0xFF, sizeof (host_flash));
+	put_enter (&s);
+	put_erase (&s, 0);
+	for (i=0; i<2; ++i) {
+		page = pages[i];
+		put_load_address (&s, page * PAGE);
+		put_reply_status (&s, CMD_LOAD_ADDRESS, STATUS_CMD_OK);
+		body[0] = CMD_PROGRAM_FLASH_ISP;
+		body[1] = PAGE >> 8;
+		body[2] = PAGE & 0xFF;
+		memset (body + 3, 0, 7);
+		memset (body + 10, 0, PAGE);
+		put_frame (&s, body, 10 + PAGE, 0);
+		put_reply (&s, reply, 2);
+		put_program (&s, CMD_PROGRAM_FLASH_ISP, page * PAGE,
+			image + page * PAGE, PAGE);
+		put_reply_status (&s, CMD_PROGRAM_FLASH_ISP, STATUS_CMD_OK);
+	}
+#ifdef EXT_FRAME
+	/* Extended frame over several pages */
+	put_load_address (&s, 8 * PAGE);
+	put_reply_status (&s, CMD_LOAD_ADDRESS, STATUS_CMD_OK);
+	body[0] = CMD_PROGRAM_FLASH_ISP;
+	body[1] = (EXT_PAGES * PAGE) >> 8;
+	body[2] = (EXT_PAGES * PAGE) & 0xFF;
+	memset (body + 3, 0, 7);
+	memset (body + 10, 0, EXT_PAGES * PAGE);
+	put_ext_frame (&s, body, 10 + EXT_PAGES * PAGE, 0);
+	put_reply (&s, reply, 2);
+	memcpy (body + 10, image + 8 * PAGE, EXT_PAGES * PAGE);
+	put_ext_frame (&s, body, 10 + EXT_PAGES * PAGE, 1);
+	put_reply_status (&s, CMD_PROGRAM_FLASH_ISP, STATUS_CMD_OK);
+#endif
+	put_leave (&s, 1);
+	run_check ("rejected", &s, 1);
+
+	expect_flash ("rejected", 0, image, PAGE);
+	expect_flash ("rejected", 3 * PAGE, image + 3 * PAGE, PAGE);
+#ifdef EXT_FRAME
+	expect_flash ("rejected", 8 * PAGE, image + 8 * PAGE,
+		EXT_PAGES * PAGE);
+#endif
+}
+
+#ifdef INCREMENTAL
+/*
+ * Update an old image, where every eighth page is changed:
+ * only these pages are erased and written.
+ */
+static void check_incremental ()
+{
+	struct script s = {0};
+	static unsigned char update [BADDR];
+	unsigned long page;
+
+	memcpy (host_flash, image, BADDR);
+	memcpy (update, image, BADDR);
+	for (page=0; page<NPAGES; page+=8)
+		update [page * PAGE + 7] ^= 0x5A;
+	put_enter (&s);
+
+	/* Refused before chip erase */
+	put_program (&s, CMD_UPDATE_FLASH_ISP, 0, update, PAGE);
+	put_reply_status (&s, CMD_UPDATE_FLASH_ISP, STATUS_CMD_FAILED);
+
+	put_erase (&s, 0);
+	for (page=0; page<NPAGES; ++page) {
+		put_program (&s, CMD_UPDATE_FLASH_ISP, page * PAGE,
+			update + page * PAGE, PAGE);
+		put_reply_status (&s, CMD_UPDATE_FLASH_ISP, STATUS_CMD_OK);
+	}
+	put_leave (&s, 1);
+	run_check ("incremental", &s, 1);
+
+	expect_flash ("incremental", 0, update, BADDR);
+	/* Page 0 is also erased by chip erase, and written twice:
+	 * word 0 is deferred until leave */
+	expect_count ("incremental", "page erases", host_stats.erases,
+		NPAGES / 8 + 1);
+	expect_count ("incremental", "page writes", host_stats.writes,
+		NPAGES / 8 + 1);
+}
+#endif
+
+#ifdef PACKED
+/*
+ * Pack data with run-length encoding: n < 128 is followed
+ * by n+1 literal bytes, n >= 128 by a byte repeated n-126 times.
+ */
+static unsigned pack (unsigned char *out, const unsigned char *data,
+	unsigned n)
+{
+	unsigned i = 0, len = 0, run, lit;
+
+	while (i < n) {
+		for (run=1; i+run<n && run<129 && data[i+run]==data[i]; ++run)
+			continue;
+		if (run >= 3) {
+			out[len++] = run + 126;
+			out[len++] = data[i];
+			i += run;
+			continue;
+		}
+		/* Literals up to the next run of three */
+		for (lit=1; i+lit<n && lit<128; ++lit) {
+			if (i+lit+2 < n && data[i+lit] == data[i+lit+1] &&
+			    data[i+lit] == data[i+lit+2])
+				break;
+		}
+		out[len++] = lit - 1;
+		memcpy (out + len, data + i, lit);
+		len += lit;
+		i += lit;
+	}
+	return len;
+}
+
+/*
+ * Program an image with runs of bytes by packed frames,
+ * half a page per frame.
+ */
+static void check_packed ()
+{
+	struct script s = {0};
+	static unsigned char data [BADDR];
+	unsigned char body [10 + PAGE + PAGE/128 + 1];
+	unsigned long i, addr;
+	unsigned n;
+
+	for (i=0; i<BADDR; ++i)
+		data[i] = (i % 64 < 40) ? i / 64 : image[i];
+	put_enter (&s);
+	put_erase (&s, NPAGES);
+	for (addr=0; addr<BADDR; addr+=PAGE/2) {
+		put_load_address (&s, addr);
+		put_reply_status (&s, CMD_LOAD_ADDRESS, STATUS_CMD_OK);
+		body[0] = CMD_PROGRAM_PACKED_ISP;
+		body[1] = 0;
+		body[2] = PAGE/2;
+		memset (body + 3, 0, 7);
+		n = pack (body + 10, data + addr, PAGE/2);
+		put_frame (&s, body, 10 + n, 1);
+		put_reply_status (&s, CMD_PROGRAM_PACKED_ISP, STATUS_CMD_OK);
+	}
+	put_leave (&s, 1);
+	run_check ("packed", &s, 1);
+	expect_flash ("packed", 0, data, BADDR);
+}
+#endif
+
+#ifdef PATTERN_FILL
+/*
+ * Fill a range, which starts and ends inside of pages.
+ */
+static void check_fill ()
+{
+	struct script s = {0};
+	unsigned char body [7], pattern [2] = { 0x5A, 0xA5 };
+	unsigned long start = 3 * PAGE + 64, count = 5 * PAGE - 100, i;
+
+	memset (host_flash, 0xFF, sizeof (host_flash));
+	put_enter (&s);
+	put_erase (&s, 0);
+	put_load_address (&s, start);
+	put_reply_status (&s, CMD_LOAD_ADDRESS, STATUS_CMD_OK);
+	body[0] = CMD_FILL_FLASH_ISP;
+	body[1] = count >> 24;
+	body[2] = count >> 16;
+	body[3] = count >> 8;
+	body[4] = count;
+	body[5] = pattern[0];
+	body[6] = pattern[1];
+	put_frame (&s, body, 7, 1);
+	put_reply_status (&s, CMD_FILL_FLASH_ISP, STATUS_CMD_OK);
+	put_leave (&s, 0);
+	run_check ("fill", &s, 1);
+
+	expect_empty ("fill", 0, start);
+	for (i=0; i<count; i+=2)
+		expect_flash ("fill", start + i, pattern, 2);
+	expect_empty ("fill", start + count, BADDR - start - count);
+}
+#endif
+
+#ifdef CRC_RANGE
+static void put_crc (struct script *s, unsigned long addr,
+	unsigned long count, const unsigned char *data)
+{
+	unsigned char body [5], reply [4];
+	unsigned short sum = 0;
+	unsigned long i;
+
+	put_load_address (s, addr);
+	put_reply_status (s, CMD_LOAD_ADDRESS, STATUS_CMD_OK);
+	body[0] = CMD_CRC_FLASH_ISP;
+	body[1] = count >> 24;
+	body[2] = count >> 16;
+	body[3] = count >> 8;
+	body[4] = count;
+	put_frame (s, body, 5, 1);
+	if (! data) {
+		put_reply_status (s, CMD_CRC_FLASH_ISP, STATUS_CMD_FAILED);
+		return;
+	}
+	/* Range is limited by the boot section */
+	for (i=0; i<count && addr+i<BADDR; ++i)
+		sum = crc16 (sum, data [addr + i]);
+	reply[0] = CMD_CRC_FLASH_ISP;
+	reply[1] = STATUS_CMD_OK;
+	reply[2] = sum >> 8;
+	reply[3] = sum;
+	put_reply (s, reply, 4);
+}
+
+/*
+ * Before chip erase, checksums only of whole pages, and no
+ * programming. After chip erase, checksums of any range.
+ */
+static void check_crc ()
+{
+	struct script s = {0};
+	static unsigned char data [BADDR];
+
+	memcpy (host_flash, image, BADDR);
+	put_enter (&s);
+	put_crc (&s, PAGE, 2 * PAGE, image);
+	put_crc (&s, PAGE, 2 * PAGE + 2, 0);
+	put_crc (&s, PAGE + 2, 2 * PAGE, 0);
+	put_program (&s, CMD_PROGRAM_FLASH_ISP, PAGE, image, PAGE);
+	put_reply_status (&s, CMD_PROGRAM_FLASH_ISP, STATUS_CMD_FAILED);
+#ifdef PACKED
+	put_program (&s, CMD_PROGRAM_PACKED_ISP, PAGE, image, 0);
+	put_reply_status (&s, CMD_PROGRAM_PACKED_ISP, STATUS_CMD_FAILED);
+#endif
+	put_erase (&s, NPAGES);
+	memset (data, 0xFF, BADDR);
+	memcpy (data + PAGE, image, PAGE);
+	put_program (&s, CMD_PROGRAM_FLASH_ISP, PAGE, image, PAGE);
+	put_reply_status (&s, CMD_PROGRAM_FLASH_ISP, STATUS_CMD_OK);
+	put_crc (&s, PAGE + 2, 3, data);
+	put_crc (&s, 0, BADDR + PAGE, data);
+	put_leave (&s, 0);
+	run_check ("crc", &s, 1);
+	expect_flash ("crc", 0, data, BADDR);
+}
+#endif
+
+#ifdef VERIFY
+/*
+ * Program a page twice with different data after chip erase:
+ * the second write cannot set bits, verify fails.
+ */
+static void check_verify ()
+{
+	struct script s = {0};
+	unsigned char data [PAGE];
+	unsigned i;
+
+	memcpy (host_flash, image, BADDR);
+	for (i=0; i<PAGE; ++i)
+		data[i] = ~image [5 * PAGE + i];
+	put_enter (&s);
+	put_erase (&s, NPAGES);
+	put_program (&s, CMD_PROGRAM_FLASH_ISP, 5 * PAGE, image + 5 * PAGE, PAGE);
+	put_reply_status (&s, CMD_PROGRAM_FLASH_ISP, STATUS_CMD_OK);
+	put_program (&s, CMD_PROGRAM_FLASH_ISP, 5 * PAGE, data, PAGE);
+	put_reply_status (&s, CMD_PROGRAM_FLASH_ISP, STATUS_VERIFY_FAILED);
+	put_leave (&s, 0);
+	run_check ("verify", &s, 1);
+}
+#endif
+
+#ifdef EEPROM
+#define EE_SIZE		HOST_EEPROM_SIZE
+
+static void put_ee_program (struct script *s, unsigned addr,
+	const unsigned char *data, unsigned n, unsigned char status)
+{
+	unsigned char body [10 + PAGE];
+
+	/* Byte address of EEPROM, given as word address */
+	put_load_address (s, 2 * addr);
+	put_reply_status (s, CMD_LOAD_ADDRESS, STATUS_CMD_OK);
+	body[0] = CMD_PROGRAM_EEPROM_ISP;
+	body[1] = n >> 8;
+	body[2] = n;
+	memset (body + 3, 0, 7);
+	memcpy (body + 10, data, n);
+	put_frame (s, body, 10 + n, 1);
+	put_reply_status (s, CMD_PROGRAM_EEPROM_ISP, status);
+}
+
+static void put_ee_read (struct script *s, unsigned addr,
+	const unsigned char *data, unsigned n)
+{
+	unsigned char reply [3 + PAGE];
+
+	put_load_address (s, 2 * addr);
+	put_reply_status (s, CMD_LOAD_ADDRESS, STATUS_CMD_OK);
+	put_read (s, CMD_READ_EEPROM_ISP, n);
+	if (! data) {
+		put_reply_status (s, CMD_READ_EEPROM_ISP, STATUS_CMD_FAILED);
+		return;
+	}
+	reply[0] = CMD_READ_EEPROM_ISP;
+	reply[1] = STATUS_CMD_OK;
+	memcpy (reply + 2, data, n);
+	reply[2 + n] = STATUS_CMD_OK;
+	put_reply (s, reply, 3 + n);
+}
+
+/*
+ * After chip erase, program the first kbyte of EEPROM
+ * in ascending order, then single bytes of the upper half
+ * in random order, and read it all back: the rest is erased.
+ * Old contents are random, so the erase has work to do:
+ * reads and leave must not wait for it.
+ * Commands beyond the end of EEPROM fail.
+ */
+static void check_eeprom ()
+{
+	struct script s = {0};
+	unsigned char data [EE_SIZE];
+	unsigned addr [EE_SIZE / 16], i, k, t;
+
+	for (i=0; i<EE_SIZE; ++i)
+		host_eeprom[i] = rand ();
+	memset (data, 0xFF, EE_SIZE);
+#ifdef RS485
+	host_eeprom [EE_SIZE - 1] = NODE;
+	data [EE_SIZE - 1] = NODE;
+#endif
+	memset (host_flash, 0xFF, sizeof (host_flash));
+	put_enter (&s);
+	put_erase (&s, 0);
+	for (i=0; i<1024; ++i)
+		data[i] = image[i];
+	for (i=0; i<1024; i+=PAGE)
+		put_ee_program (&s, i, data + i, PAGE, STATUS_CMD_OK);
+
+	/* Every 8th byte of the upper half, shuffled */
+	for (i=0; i<EE_SIZE/16; ++i)
+		addr[i] = EE_SIZE/2 + 8*i;
+	for (i=EE_SIZE/16-1; i>0; --i) {
+		k = rand () % (i + 1);
+		t = addr[i];
+		addr[i] = addr[k];
+		addr[k] = t;
+	}
+	for (i=0; i<EE_SIZE/16; ++i) {
+		data [addr[i]] = image [2048 + i];
+		put_ee_program (&s, addr[i], data + addr[i], 1, STATUS_CMD_OK);
+	}
+
+	put_ee_program (&s, EE_SIZE - 1, data, 2, STATUS_CMD_FAILED);
+	put_ee_read (&s, EE_SIZE - 1, 0, 2);
+	for (i=0; i<EE_SIZE; i+=PAGE)
+		put_ee_read (&s, i, data + i, PAGE);
+	put_leave (&s, 0);
+	/* The erase goes on after leave */
+	s.chunk [s.nchunks - 1].delay = EE_SIZE * ee_polls;
+	run_check ("eeprom", &s, 1);
+
+	for (i=0; i<EE_SIZE; ++i) {
+		if (host_eeprom[i] != data[i]) {
+			printf ("eeprom: differs at 0x%x\n", i);
+			errors++;
+			break;
+		}
+	}
+}
+#endif
+
+#ifdef FLASH_API
+static unsigned char api_data [PAGE];
+static unsigned char api_status;
+
+/*
+ * The application programs a page, and tries the boot section.
+ */
+static void api_program ()
+{
+	unsigned i;
+
+	api_status = flash_erase (7 * PAGE);
+	for (i=0; i<PAGE; i+=2)
+		flash_fill (i, api_data[i] | api_data[i+1] << 8);
+	api_status |= flash_write (7 * PAGE) << 1;
+	flash_rww ();
+	api_status |= (flash_erase (BADDR) == 0) << 2;
+	api_status |= (flash_write (BADDR) == 0) << 3;
+}
+
+static void check_api ()
+{
+	unsigned i;
+
+	memcpy (host_flash, image, BADDR);
+	for (i=0; i<PAGE; ++i)
+		api_data[i] = i;
+	memset (&host_stats, 0, sizeof (host_stats));
+	set_timing (1);
+	host_app (api_program);
+	check_hardware ("api");
+	if (api_status != 0) {
+		printf ("api: status 0x%x\n", api_status);
+		errors++;
+	}
+	expect_flash ("api", 7 * PAGE, api_data, PAGE);
+	expect_flash ("api", 8 * PAGE, image + 8 * PAGE, PAGE);
+	expect_count ("api", "page erases", host_stats.erases, 1);
+	expect_count ("api", "page writes", host_stats.writes, 1);
+}
+#endif
+
+#ifdef STAGING
+#define STAGE_NPAGES	8
+
+/*
+ * The application stores a new image into the staging area,
+ * with the info page last.
+ */
+static void api_stage ()
+{
+	unsigned char info [PAGE];
+	unsigned short sum = 0;
+	unsigned long i;
+
+	api_status = stage_write (STAGE_ADDR + 1, image);
+	api_status |= stage_write (BADDR, image) << 1;
+	for (i=0; i<STAGE_NPAGES; ++i)
+		api_status |= stage_write (STAGE_ADDR + i * PAGE,
+			image + i * PAGE) == 0 ? 0 : 4;
+	for (i=0; i<STAGE_NPAGES * PAGE; ++i)
+		sum = crc16 (sum, image[i]);
+	memset (info, 0xFF, PAGE);
+	info[0] = 0x54;
+	info[1] = 0x53;
+	info[2] = STAGE_NPAGES;
+	info[3] = 0;
+	info[4] = sum;
+	info[5] = sum >> 8;
+	api_status |= stage_write (STAGE_INFO, info) == 0 ? 0 : 8;
+}
+
+/*
+ * Over an empty flash, the image is staged by the application,
+ * then copied by the boot loader on cold boot.
+ */
+static void check_staging ()
+{
+	struct host_chunk wait = { 0, 0, HOST_MSEC (1000), 0 };
+
+	memset (host_flash, 0xFF, sizeof (host_flash));
+	memset (&host_stats, 0, sizeof (host_stats));
+	set_timing (1);
+	host_app (api_stage);
+	if (api_status != 3) {
+		printf ("staging: status 0x%x\n", api_status);
+		errors++;
+	}
+	host_run (0, &wait, 1, 0);
+
+	/* The greeting is cut by the application start */
+	host_stats.tx_lost = 0;
+	check_hardware ("staging");
+	expect_count ("staging", "application starts",
+		host_stats.app_starts, 1);
+	expect_flash ("staging", 0, image, STAGE_NPAGES * PAGE);
+	expect_empty ("staging", STAGE_INFO, PAGE);
+}
+#endif
+
+#ifdef ENTRY_WINDOW
+/*
+ * Cold boot with an application: it is started after the window,
+ * unless the host sends the sync bytes.
+ */
+static void check_window ()
+{
+	struct script s = {0};
+	struct host_chunk wait = { 0, 0, HOST_MSEC (2 * ENTRY_WINDOW), 0 };
+
+	memcpy (host_flash, image, BADDR);
+	set_timing (1);
+	memset (&host_stats, 0, sizeof (host_stats));
+	host_run (0, &wait, 1, 0);
+	check_hardware ("window");
+	expect_count ("window", "application starts",
+		host_stats.app_starts, 1);
+	expect_count ("window", "bytes of output", host_output_len, 0);
+
+	put_byte (&s, 'S');
+	put_byte (&s, 'B');
+	put_enter (&s);
+	put_leave (&s, 1);
+	run_check ("window", &s, 0);
+#ifndef RS485
+	if (host_output_len < 6 || memcmp (host_output, "Boot\r\n", 6) != 0) {
+		printf ("window: no greeting\n");
+		errors++;
+	}
+#endif
+}
+#endif
+
+static void copy_script (struct script *to, const struct script *from)
+{
+	size_t i;
+
+	for (i=0; i<from->len; ++i)
+		put_byte (to, from->data[i]);
+	for (i=0; i<from->nchunks; ++i) {
+		put_chunk (to, from->chunk[i].answers);
+		to->chunk [to->nchunks - 1] = from->chunk[i];
+	}
+	to->nframes = from->nframes;
+	to->seqnum = from->seqnum;
+}
+
+int main (int argc, char **argv)
+{
+	struct script program = {0}, readback = {0}, checksum = {0}, parser = {0};
+#ifdef RS485
+	struct script program_bcast = {0};
+#endif
+#ifdef BAUD_SWITCH
+	struct script baud = {0};
+#endif
+#ifdef EXT_FRAME
+	struct script program_ext = {0};
+	unsigned char body [10 + EXT_PAGES * PAGE];
+#else
+	unsigned char body [10 + PAGE];
+#endif
+	unsigned long page, i;
+	unsigned short sum;
+	double sec;
+	int ch;
+
+	while ((ch = getopt (argc, argv, "s:e:b:")) != -1) {
+		switch (ch) {
+		case 's':
+			spm_polls = strtoul (optarg, 0, 0);
+			break;
+		case 'e':
+			ee_polls = strtoul (optarg, 0, 0);
+			break;
+		case 'b':
+			byte_polls = strtoul (optarg, 0, 0);
+			break;
+		default:
+			fprintf (stderr, "Usage: stkboot-host [-s polls] [-e polls] [-b polls]\n");
+			return 1;
+		}
+	}
+	srand (1);
+	for (i=0; i<sizeof (image); ++i)
+		image[i] = rand ();
+	memset (host_flash, 0xFF, sizeof (host_flash));
+#ifdef RS485
+	host_eeprom [HOST_EEPROM_SIZE - 1] = NODE;
+#endif
+
+	/* Program the whole application area */
+	put_reset (&program);
+	put_cmd (&program, CMD_SIGN_ON, 0, 0);
+	put_cmd (&program, CMD_ENTER_PROGMODE_ISP, 0, 0);
+	put_cmd (&program, CMD_CHIP_ERASE_ISP, 0, 0);
+	for (page=0; page<NPAGES; ++page) {
+		put_load_address (&program, page * PAGE);
+		body[0] = CMD_PROGRAM_FLASH_ISP;
+		body[1] = PAGE >> 8;
+		body[2] = PAGE & 0xFF;
+		memset (body + 3, 0, 7);
+		memcpy (body + 10, image + page * PAGE, PAGE);
+		put_frame (&program, body, 10 + PAGE, 1);
+	}
+
+	/* Program, then read it back. Leave progmode at the end:
+	 * with LEAVE_START, the session ends there. */
+	copy_script (&readback, &program);
+	for (page=0; page<NPAGES; ++page) {
+		put_load_address (&readback, page * PAGE);
+		put_read (&readback, CMD_READ_FLASH_ISP, PAGE);
+	}
+	put_cmd (&readback, CMD_LEAVE_PROGMODE_ISP, 1, 1);
+
+	/* Program, then get checksums */
+	copy_script (&checksum, &program);
+	for (page=0; page<NPAGES; ++page) {
+		put_load_address (&checksum, page * PAGE);
+		put_read (&checksum, CMD_READ_FLASH_ISP | 0x80, PAGE);
+	}
+	put_cmd (&checksum, CMD_LEAVE_PROGMODE_ISP, 1, 1);
+	put_cmd (&program, CMD_LEAVE_PROGMODE_ISP, 1, 1);
+
+#ifdef EXT_FRAME
+	/* Program with extended frames, several pages per frame */
+	put_reset (&program_ext);
+	put_cmd (&program_ext, CMD_SIGN_ON, 0, 0);
+	put_cmd (&program_ext, CMD_ENTER_PROGMODE_ISP, 0, 0);
+	put_cmd (&program_ext, CMD_CHIP_ERASE_ISP, 0, 0);
+	for (page=0; page<NPAGES; page+=EXT_PAGES) {
+		unsigned n = (NPAGES - page < EXT_PAGES ?
+			NPAGES - page : EXT_PAGES) * PAGE;
+
+		put_load_address (&program_ext, page * PAGE);
+		body[0] = CMD_PROGRAM_FLASH_ISP;
+		body[1] = n >> 8;
+		body[2] = n & 0xFF;
+		memset (body + 3, 0, 7);
+		memcpy (body + 10, image + page * PAGE, n);
+		put_ext_frame (&program_ext, body, 10 + n, 1);
+	}
+	put_cmd (&program_ext, CMD_LEAVE_PROGMODE_ISP, 1, 1);
+#endif
+#ifdef RS485
+	/* Program all nodes at once with no answers, then poll.
+	 * The host waits after broadcast commands, as in README:
+	 * 5 msec per page erased, 10 msec per page programmed,
+	 * 9 msec more with EEPROM. */
+	program_bcast.broadcast = 1;
+	put_reset (&program_bcast);
+	put_cmd (&program_bcast, CMD_ENTER_PROGMODE_ISP, 0, 0);
+	put_cmd (&program_bcast, CMD_CHIP_ERASE_ISP, 0, 0);
+#ifdef LAZY_ERASE
+	program_bcast.chunk [program_bcast.nchunks - 1].delay =
+		spm_polls * 10 / 9;
+#else
+	program_bcast.chunk [program_bcast.nchunks - 1].delay =
+		NPAGES * spm_polls * 10 / 9;
+#endif
+	for (page=0; page<NPAGES; ++page) {
+		put_load_address (&program_bcast, page * PAGE);
+		body[0] = CMD_PROGRAM_FLASH_ISP;
+		body[1] = PAGE >> 8;
+		body[2] = PAGE & 0xFF;
+		memset (body + 3, 0, 7);
+		memcpy (body + 10, image + page * PAGE, PAGE);
+		put_frame (&program_bcast, body, 10 + PAGE, 1);
+		program_bcast.chunk [program_bcast.nchunks - 1].delay =
+#ifdef EEPROM
+			ee_polls * 18 / 17 +
+#endif
+			2 * spm_polls * 10 / 9;
+	}
+	program_bcast.broadcast = 0;
+	put_cmd (&program_bcast, CMD_GET_PARAMETER, 0xC3, 0);
+	put_cmd (&program_bcast, CMD_GET_PARAMETER, 0xC4, 0);
+	put_cmd (&program_bcast, CMD_LEAVE_PROGMODE_ISP, 1, 1);
+#endif
+
+#ifdef BAUD_SWITCH
+	/* Switch to 230400 and use it, then switch to 460800
+	 * and stay at 230400: the device falls back to BAUDRATE */
+	put_reset (&baud);
+	put_cmd (&baud, CMD_SIGN_ON, 0, 0);
+	put_reply (&baud, 0, 0);
+	put_cmd (&baud, CMD_SET_PARAMETER, 0xC0, 230400 / 4800);
+	put_reply_status (&baud, CMD_SET_PARAMETER, STATUS_CMD_OK);
+	put_cmd (&baud, CMD_GET_PARAMETER, 0xC0, 0);
+	baud.chunk [baud.nchunks - 1].baud = 230400;
+	body[0] = CMD_GET_PARAMETER;
+	body[1] = STATUS_CMD_OK;
+	body[2] = 230400 / 4800;
+	put_reply (&baud, body, 3);
+	put_cmd (&baud, CMD_SET_PARAMETER, 0xC0, 460800 / 4800);
+	baud.chunk [baud.nchunks - 1].baud = 230400;
+	baud.chunk [baud.nchunks - 1].delay = HOST_MSEC (1100);
+	put_reply_status (&baud, CMD_SET_PARAMETER, STATUS_CMD_OK);
+	put_cmd (&baud, CMD_GET_PARAMETER, 0xC0, 0);
+	body[2] = BAUDRATE / 4800;
+	put_reply (&baud, body, 3);
+#endif
+
+	/* Frames with bad checksum: parser only */
+	memset (body, 0x55, sizeof (body));
+	put_reset (&parser);
+	for (page=0; page<NPAGES; ++page)
+		put_frame (&parser, body, 10 + PAGE, 0);
+
+	printf ("%-12s %8s %10s %12s %10s\n", "benchmark", "frames",
+		"bytes", "frames/s", "ns/byte");
+
+	sec = run ("program", &program, 0, 0, 0);
+	if (check_answers ("program", expect_ok) != program.nframes) {
+		printf ("program: answers missing\n");
+		errors++;
+	}
+	if (memcmp (host_flash, image, BADDR) != 0) {
+		printf ("program: flash contents differ\n");
+		errors++;
+	}
+
+	run ("readback", &readback, program.len, program.nframes, sec);
+	read_page = 0;
+	if (check_answers ("readback", expect_data) != readback.nframes) {
+		printf ("readback: answers missing\n");
+		errors++;
+	}
+
+	run ("checksum", &checksum, program.len, program.nframes, sec);
+	read_page = 0;
+	if (check_answers ("checksum", expect_crc) != checksum.nframes) {
+		printf ("checksum: answers missing\n");
+		errors++;
+	}
+
+#ifdef EXT_FRAME
+	memset (host_flash, 0xFF, sizeof (host_flash));
+	run ("program-ext", &program_ext, 0, 0, 0);
+	if (check_answers ("program-ext", expect_ok) != program_ext.nframes) {
+		printf ("program-ext: answers missing\n");
+		errors++;
+	}
+	if (memcmp (host_flash, image, BADDR) != 0) {
+		printf ("program-ext: flash contents differ\n");
+		errors++;
+	}
+#endif
+#ifdef RS485
+	memset (host_flash, 0xFF, sizeof (host_flash));
+	run ("program-bcast", &program_bcast, 0, 0, 0);
+	if (check_answers ("program-bcast", expect_node) != 3) {
+		printf ("program-bcast: 3 answers expected\n");
+		errors++;
+	}
+	if (memcmp (host_flash, image, BADDR) != 0) {
+		printf ("program-bcast: flash contents differ\n");
+		errors++;
+	}
+#endif
+#ifdef BAUD_SWITCH
+	run_check ("baud", &baud, 1);
+#endif
+
+	/* Checks of options, with hardware timing */
+	check_erase ();
+	check_rejected ();
+#ifdef INCREMENTAL
+	check_incremental ();
+#endif
+#ifdef PACKED
+	check_packed ();
+#endif
+#ifdef PATTERN_FILL
+	check_fill ();
+#endif
+#ifdef CRC_RANGE
+	check_crc ();
+#endif
+#ifdef VERIFY
+	check_verify ();
+#endif
+#ifdef EEPROM
+	check_eeprom ();
+#endif
+#ifdef FLASH_API
+	check_api ();
+#endif
+#ifdef STAGING
+	check_staging ();
+#endif
+#ifdef ENTRY_WINDOW
+	check_window ();
+#endif
+	run ("parser", &parser, 0, 0, 0);
+	if (check_answers ("parser", expect_cksum_error) != parser.nframes) {
+		printf ("parser: answers missing\n");
+		errors++;
+	}
+	/* CRC of 16 Mbytes */
+	sum = 0;
+	sec = now ();
+	for (i=0; i<16*1024*1024; ++i)
+		sum = crc16 (sum, i);
+	sec = now () - sec;
+	printf ("crc16: %.1f Mbytes/sec (sum %04x)\n", 16 / sec, sum);
+
+	if (errors) {
+		printf ("%d errors\n", errors);
+		return 1;
+	}
+	return 0;
+}
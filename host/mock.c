@@ -0,0 +1,674 @@
+/*
+ * Host build of stkboot: mocked registers, flash memory and UART.
+ * Flash is an array, spm instruction is emulated with the same
+ * semantics as on the chip: words are loaded into a page buffer,
+ * page write clears bits only, the page buffer is cleared
+ * after page write and by RWW section enable. A word loaded twice
+ * without clearing is undefined on the chip: here the bits
+ * are cleared, so the page shows it.
+ *
+ * Time goes by polls of registers. Page erase and write keep SPMEN
+ * set for host_spm_polls, and the RWW section is busy until
+ * re-enabled. EEPROM write keeps EEWE set for host_ee_polls.
+ * UART bytes take host_byte_polls on the line, with a receive
+ * FIFO of two bytes, as on the chip. Misuse of the hardware
+ * is counted in host_stats.
+ *
+ * UART is fed from chunks of input, as a host would send them,
+ * or from a file descriptor.
+ */
+#include <errno.h>
+#include <poll.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "runtime/avr/io.h"
+#include "mock.h"
+
+#ifndef TOKEN
+#define TOKEN		0x0E
+#endif
+#define MESSAGE_START	0x1B
+
+volatile unsigned char RAMPZ;
+volatile unsigned char UBRR0L, UBRR0H, UCSR0B, UCSR0C;
+volatile unsigned char WDTCR, MCUCR, GICR, TCCR1B;
+volatile unsigned char SREG;
+volatile unsigned char PORTD, DDRD;
+
+unsigned long host_spm_polls = HOST_SPM_POLLS;
+unsigned long host_ee_polls = HOST_EE_POLLS;
+unsigned long host_byte_polls = HOST_BYTE_POLLS;
+unsigned long host_timeout = HOST_MSEC (15000);
+
+unsigned short host_r0r1;
+unsigned char host_flash [HOST_FLASH_SIZE];
+unsigned char host_eeprom [HOST_EEPROM_SIZE];
+struct host_stats host_stats;
+unsigned char *host_output;
+size_t host_output_len;
+unsigned long host_lost_write;
+
+/* Flash */
+static unsigned char spmcsr;
+static unsigned char page_buf [HOST_PAGE_BYTES];
+static unsigned long spm_left;		/* polls until erase or write is done */
+static unsigned char spm_busy;		/* command in progress */
+static unsigned long spm_page;
+static int rww_busy;			/* RWW section is not re-enabled */
+
+/* EEPROM */
+static unsigned char eecr;
+static unsigned long ee_left;
+
+/* Timer1 */
+static unsigned short tcnt1;
+static unsigned long timer_cycles;
+
+/* UART */
+static unsigned char ucsra;		/* U2X and MPCM bits */
+static unsigned short udr;		/* 0x1xx until written */
+static int udr_accessed;
+static unsigned char rx_fifo [2];
+static int rx_count;
+static int in_interrupt;
+static int rx_wait;			/* receive ring is empty */
+static unsigned char tx_data, tx_shift;
+static int tx_full, tx_busy, tx_ok, txc;
+static unsigned long tx_left;
+
+/* Host side */
+static const unsigned char *input;
+static const struct host_chunk *chunk;
+static unsigned nchunks, cur;
+static size_t input_pos, chunk_pos;
+static enum { SEND, ANSWER, DELAY, DONE, APP } host_state;
+static unsigned long host_wait;
+static unsigned answers_wanted, answers_seen;
+static int line_busy, line_ok;
+static unsigned char line_byte;
+static unsigned long line_left;
+static size_t output_size;
+static jmp_buf session_end;
+
+/* Answer frames in the output */
+static int out_state;
+static unsigned out_need;
+static int out_ext;
+
+/* Serving a file descriptor */
+static int serve_fd = -1;
+static int serve_used;
+static unsigned char serve_buf [4096];
+static size_t serve_len, serve_pos;
+static unsigned long serve_idle;
+
+#ifdef RX_INTERRUPT
+void __vector_uart_rx (void);
+#endif
+
+/*
+ * Rate of the UART, compared with the rate of the host.
+ */
+static int rate_ok (unsigned long baud)
+{
+	unsigned long rate;
+
+	rate = KHZ * 1000L / ((ucsra & (1 << U2X)) ? 8 : 16) /
+		((UBRR0H << 8 | UBRR0L) + 1);
+	return rate * 100 >= baud * 97 && rate * 100 <= baud * 103;
+}
+
+static unsigned long host_baud ()
+{
+	if (serve_fd < 0 && cur < nchunks && chunk[cur].baud != 0)
+		return chunk[cur].baud;
+	return BAUDRATE;
+}
+
+/*
+ * Count answer frames, to know when the host may go on.
+ */
+static void parse_answer (unsigned char c)
+{
+	switch (out_state) {
+	case 0:
+		if (c == MESSAGE_START)
+			out_state = 1;
+		return;
+	case 1:
+#ifdef RS485
+		/* Node address */
+		out_state = 2;
+		return;
+	case 2:
+#endif
+		/* Sequence number */
+		out_state = 3;
+		return;
+	case 3:
+		out_need = c << 8;
+		out_state = 4;
+		return;
+	case 4:
+		out_need |= c;
+		out_state = 5;
+		return;
+	case 5:
+		out_ext = (c == (TOKEN | 0x80));
+		out_state = (c == TOKEN || out_ext) ? 6 : 0;
+		/* Body and checksum */
+		out_need += out_ext ? 2 : 1;
+		return;
+	case 6:
+		if (--out_need > 0)
+			return;
+		answers_seen++;
+		out_state = 0;
+		return;
+	}
+}
+
+static void output (unsigned char c)
+{
+	if (host_output_len >= output_size) {
+		output_size = output_size ? output_size * 2 : 4096;
+		host_output = realloc (host_output, output_size);
+		if (! host_output)
+			abort ();
+	}
+	host_output [host_output_len++] = c;
+	parse_answer (c);
+}
+
+/*
+ * Page erase or write is complete.
+ */
+static void spm_done ()
+{
+	unsigned i;
+
+	if (spm_busy & (1 << PGERS)) {
+		memset (host_flash + spm_page, 0xFF, HOST_PAGE_BYTES);
+	} else {
+		if (host_stats.writes != host_lost_write) {
+			for (i=0; i<HOST_PAGE_BYTES; ++i)
+				host_flash [spm_page + i] &= page_buf [i];
+		}
+		memset (page_buf, 0xFF, HOST_PAGE_BYTES);
+	}
+	spm_busy = 0;
+	spm_left = 0;
+	spmcsr = rww_busy ? 1 << RWWSB : 0;
+}
+
+/*
+ * Resolve the last access to UDR: a write leaves a byte
+ * in the register, a read takes the byte from receive FIFO.
+ */
+static void udr_resolve ()
+{
+	udr_accessed = 0;
+	if ((udr & 0xFF00) == 0x100) {
+		if (rx_count > 0) {
+			rx_fifo[0] = rx_fifo[1];
+			rx_count--;
+		}
+		return;
+	}
+	if (! (UCSR0B & (1 << TXEN)))
+		return;
+	/* Transmit complete flag is cleared by the program
+	 * before writing UDR, assume it is */
+	txc = 0;
+	if (tx_full) {
+		host_stats.tx_lost++;
+	} else if (tx_busy) {
+		tx_data = (unsigned char) udr;
+		tx_full = 1;
+	} else {
+		tx_shift = (unsigned char) udr;
+		tx_ok = rate_ok (host_baud ());
+		tx_left = host_byte_polls;
+		tx_busy = 1;
+	}
+}
+
+static void tx_step ()
+{
+	if (! tx_busy || (tx_left > 0 && --tx_left > 0))
+		return;
+	if (tx_ok && rate_ok (host_baud ())) {
+		output (tx_shift);
+	} else {
+		host_stats.garbled++;
+		output (~tx_shift);
+	}
+	if (tx_full) {
+		tx_shift = tx_data;
+		tx_ok = rate_ok (host_baud ());
+		tx_left = host_byte_polls;
+		tx_full = 0;
+	} else {
+		tx_busy = 0;
+		txc = 1;
+	}
+}
+
+/*
+ * Byte from the host is received.
+ */
+static void rx_byte (unsigned char c, int ok)
+{
+	if (! (UCSR0B & (1 << RXEN)) || rx_count >= 2) {
+		host_stats.rx_lost++;
+		return;
+	}
+	if (! ok) {
+		host_stats.garbled++;
+		c = ~c;
+	}
+	rx_fifo [rx_count++] = c;
+}
+
+/*
+ * Send the answers to file descriptor.
+ */
+static void serve_flush ()
+{
+	size_t pos = 0;
+	ssize_t n;
+
+	while (pos < host_output_len) {
+		n = write (serve_fd, host_output + pos, host_output_len - pos);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		pos += n;
+	}
+	host_output_len = 0;
+}
+
+/*
+ * Read from file descriptor, when there is nothing else to do
+ * for a while. Until the port is opened, read fails with EIO:
+ * wait. When it is closed after use, the session ends.
+ */
+static void serve_read ()
+{
+	struct pollfd p;
+	ssize_t n;
+
+	if (spm_busy || ee_left > 0 || tx_busy || rx_count > 0) {
+		serve_idle = 0;
+		return;
+	}
+	if (++serve_idle < 1000)
+		return;
+	serve_flush ();
+	for (;;) {
+		p.fd = serve_fd;
+		p.events = POLLIN;
+		if (poll (&p, 1, 10) == 0)
+			continue;
+		n = read (serve_fd, serve_buf, sizeof (serve_buf));
+		if (n > 0) {
+			serve_len = n;
+			serve_pos = 0;
+			serve_used = 1;
+			serve_idle = 0;
+			return;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (serve_used)
+			longjmp (session_end, 1);
+		usleep (10000);
+	}
+}
+
+/*
+ * The host sends the next byte, waits for answers,
+ * or ends the session.
+ */
+static void host_step ()
+{
+	if (line_busy) {
+		if (line_left > 0 && --line_left > 0)
+			return;
+		rx_byte (line_byte, line_ok && rate_ok (host_baud ()));
+		line_busy = 0;
+	}
+	if (serve_fd >= 0) {
+		if (serve_pos >= serve_len) {
+			serve_read ();
+			return;
+		}
+		if (host_byte_polls == 0 && rx_count > 0)
+			return;
+		line_byte = serve_buf [serve_pos++];
+		line_ok = rate_ok (BAUDRATE);
+		line_left = host_byte_polls;
+		line_busy = 1;
+		return;
+	}
+	switch (host_state) {
+	case SEND:
+		if (host_byte_polls == 0 && (rx_count > 0
+#ifdef RX_INTERRUPT
+		    || ! rx_wait
+#endif
+		    )) {
+			/* Infinitely fast line: no overruns */
+			return;
+		}
+		if (chunk_pos < chunk[cur].len) {
+			line_byte = input [input_pos++];
+			line_ok = rate_ok (host_baud ());
+			line_left = host_byte_polls;
+			line_busy = 1;
+			chunk_pos++;
+			return;
+		}
+		answers_wanted += chunk[cur].answers;
+		host_wait = host_timeout;
+		host_state = ANSWER;
+		/* fall through */
+	case ANSWER:
+		if (answers_seen < answers_wanted) {
+			if (--host_wait > 0)
+				return;
+			host_stats.timeouts++;
+			answers_seen = answers_wanted;
+		}
+		host_wait = chunk[cur].delay;
+		host_state = DELAY;
+		/* fall through */
+	case DELAY:
+		if (host_wait > 0 && --host_wait > 0)
+			return;
+		chunk_pos = 0;
+		if (++cur < nchunks) {
+			host_state = SEND;
+			return;
+		}
+		host_state = DONE;
+		/* fall through */
+	case DONE:
+		if (! tx_busy && ! in_interrupt)
+			longjmp (session_end, 1);
+		return;
+	case APP:
+		/* The application runs, the host is idle */
+		return;
+	}
+}
+
+/*
+ * Time goes on by one poll.
+ */
+static void host_tick ()
+{
+	static const unsigned short prescale [8] =
+		{ 0, 1, 8, 64, 256, 1024, 0, 0 };
+	unsigned short div;
+
+	if (udr_accessed)
+		udr_resolve ();
+	if (spm_left > 0 && --spm_left == 0)
+		spm_done ();
+	if (ee_left > 0 && --ee_left == 0)
+		eecr &= ~(1 << EEWE);
+	div = prescale [TCCR1B & 7];
+	if (div != 0) {
+		timer_cycles += HOST_CYCLES;
+		tcnt1 += timer_cycles / div;
+		timer_cycles %= div;
+	}
+	tx_step ();
+	host_step ();
+#ifdef RX_INTERRUPT
+	if ((UCSR0B & (1 << RXCIE)) && (SREG & (1 << SREG_I)) &&
+	    rx_count > 0 && ! in_interrupt) {
+		/* Interrupts are disabled in the handler */
+		in_interrupt = 1;
+		SREG &= ~(1 << SREG_I);
+		__vector_uart_rx ();
+		if (udr_accessed)
+			udr_resolve ();
+		SREG |= 1 << SREG_I;
+		in_interrupt = 0;
+		rx_wait = 0;
+	}
+#endif
+}
+
+#ifdef RX_INTERRUPT
+/*
+ * The program polls the receive ring of the interrupt handler.
+ */
+unsigned char host_rx_ready (unsigned char ready)
+{
+	rx_wait = ! ready;
+	host_tick ();
+	return ready;
+}
+#endif
+
+volatile unsigned char *host_spmcsr ()
+{
+	host_tick ();
+	return &spmcsr;
+}
+
+volatile unsigned char *host_eecr ()
+{
+	host_tick ();
+	return &eecr;
+}
+
+volatile unsigned char *host_ucsra ()
+{
+	host_tick ();
+	ucsra &= (1 << U2X) | (1 << MPCM);
+	if (rx_count > 0)
+		ucsra |= 1 << RXC;
+	if (! tx_full)
+		ucsra |= 1 << UDRE;
+	if (txc)
+		ucsra |= 1 << TXC;
+	return &ucsra;
+}
+
+volatile unsigned short *host_udr ()
+{
+	host_tick ();
+	if (udr_accessed)
+		udr_resolve ();
+	udr = 0x100 | rx_fifo[0];
+	udr_accessed = 1;
+	return &udr;
+}
+
+volatile unsigned short *host_tcnt1 ()
+{
+	host_tick ();
+	return &tcnt1;
+}
+
+unsigned char host_lpm (unsigned char rampz, unsigned short addr)
+{
+	unsigned long a = ((unsigned long) rampz << 16 | addr) % HOST_FLASH_SIZE;
+
+	if (rww_busy && a < HOST_NRWW)
+		host_stats.rww_errors++;
+	return host_flash [a];
+}
+
+void host_spm (unsigned short addr)
+{
+	unsigned long a = ((unsigned long) RAMPZ << 16 | addr) % HOST_FLASH_SIZE;
+	unsigned char cmd = spmcsr;
+	unsigned i;
+
+	if (spm_busy || (eecr & (1 << EEWE))) {
+		/* Ignored by the chip */
+		host_stats.busy_errors++;
+		spmcsr = spm_busy | (rww_busy ? 1 << RWWSB : 0);
+		return;
+	}
+	if (cmd & ((1 << PGERS) | (1 << PGWRT))) {
+		if (cmd & (1 << PGERS))
+			host_stats.erases++;
+		else
+			host_stats.writes++;
+		spm_busy = cmd;
+		spm_page = a & ~(HOST_PAGE_BYTES - 1UL);
+		if (spm_page < HOST_NRWW)
+			rww_busy = 1;
+		spm_left = host_spm_polls;
+		if (spm_left == 0)
+			spm_done ();
+		else
+			spmcsr = cmd | (rww_busy ? 1 << RWWSB : 0);
+		return;
+	}
+	if (cmd & (1 << RWWSRE)) {
+		rww_busy = 0;
+		memset (page_buf, 0xFF, HOST_PAGE_BYTES);
+	} else {
+		i = addr & (HOST_PAGE_BYTES - 2);
+		page_buf [i] &= host_r0r1;
+		page_buf [i + 1] &= host_r0r1 >> 8;
+		host_stats.fills++;
+	}
+	spmcsr = rww_busy ? 1 << RWWSB : 0;
+}
+
+/*
+ * EEPROM cannot be read while a byte is written,
+ * and cannot be written while SPM is busy.
+ */
+unsigned char ee_read (unsigned short addr)
+{
+	if (eecr & (1 << EEWE))
+		host_stats.busy_errors++;
+	return host_eeprom [addr % HOST_EEPROM_SIZE];
+}
+
+void ee_start (unsigned short addr, unsigned char data)
+{
+	if ((eecr & (1 << EEWE)) || spm_busy) {
+		host_stats.busy_errors++;
+		return;
+	}
+	host_eeprom [addr % HOST_EEPROM_SIZE] = data;
+	host_stats.ee_writes++;
+	ee_left = host_ee_polls;
+	if (ee_left > 0)
+		eecr |= 1 << EEWE;
+}
+
+/*
+ * Application start ends the session. UART is reset,
+ * so bytes not shifted out yet are lost.
+ */
+void app_start ()
+{
+	if (udr_accessed)
+		udr_resolve ();
+	host_stats.app_starts++;
+	host_stats.tx_lost += tx_busy + tx_full;
+	tx_busy = 0;
+	tx_full = 0;
+	longjmp (session_end, 1);
+}
+
+/*
+ * Power on: hardware in reset state.
+ */
+static void reset ()
+{
+	spmcsr = 0;
+	spm_busy = 0;
+	spm_left = 0;
+	rww_busy = 0;
+	memset (page_buf, 0xFF, HOST_PAGE_BYTES);
+	eecr = 0;
+	ee_left = 0;
+	TCCR1B = 0;
+	tcnt1 = 0;
+	timer_cycles = 0;
+	UBRR0L = 0;
+	UBRR0H = 0;
+	UCSR0B = 0;
+	UCSR0C = 0;
+	ucsra = 0;
+	udr_accessed = 0;
+	rx_count = 0;
+	in_interrupt = 0;
+	rx_wait = 0;
+	tx_full = 0;
+	tx_busy = 0;
+	txc = 0;
+	SREG = 0;
+	line_busy = 0;
+	out_state = 0;
+	answers_seen = 0;
+	answers_wanted = 0;
+	host_output_len = 0;
+}
+
+/*
+ * Session is over: let the flash operation in progress complete.
+ */
+static void finish ()
+{
+	if (udr_accessed)
+		udr_resolve ();
+	if (spm_busy)
+		spm_done ();
+}
+
+void host_run (const unsigned char *in, const struct host_chunk *ch,
+	unsigned n, int warmboot)
+{
+	reset ();
+	input = in;
+	chunk = ch;
+	nchunks = n;
+	cur = 0;
+	input_pos = 0;
+	chunk_pos = 0;
+	host_state = (n > 0) ? SEND : DONE;
+	if (setjmp (session_end) == 0)
+		stkboot_main (warmboot, 0);
+	finish ();
+}
+
+void host_app (void (*func) (void))
+{
+	host_state = APP;
+	func ();
+	finish ();
+}
+
+void host_serve (int fd)
+{
+	reset ();
+	serve_fd = fd;
+	serve_used = 0;
+	serve_len = 0;
+	serve_pos = 0;
+	serve_idle = 0;
+	if (setjmp (session_end) == 0)
+		stkboot_main (1, 0);
+	finish ();
+
+	/* Answer before the application start */
+	serve_flush ();
+	serve_fd = -1;
+}
@@ -0,0 +1,89 @@
+/*
+ * Host build of stkboot: interface of mocked hardware.
+ */
+#include <stddef.h>
+
+#define HOST_FLASH_SIZE		0x20000		/* atmega128 */
+#define HOST_PAGE_BYTES		256
+#define HOST_NRWW		0x1E000		/* no read-while-write section */
+#define HOST_EEPROM_SIZE	0x1000
+
+/*
+ * Time is counted in polls: accesses to registers with hardware
+ * behind them. A poll loop takes about HOST_CYCLES clock cycles,
+ * which gives the default durations, and the rate of Timer1.
+ */
+#define HOST_CYCLES		16
+#define HOST_MSEC(ms)		((ms) * KHZ / HOST_CYCLES)
+#define HOST_SPM_POLLS		HOST_MSEC (4.5)	/* page erase or write */
+#define HOST_EE_POLLS		HOST_MSEC (8.5)	/* EEPROM byte write */
+#define HOST_BYTE_POLLS		(10000L * KHZ / BAUDRATE / HOST_CYCLES)
+
+extern unsigned long host_spm_polls;	/* page erase or write */
+extern unsigned long host_ee_polls;	/* EEPROM byte write */
+extern unsigned long host_byte_polls;	/* UART byte on the line */
+extern unsigned long host_timeout;	/* host waits for answer, polls */
+
+struct host_stats {
+	unsigned long erases;		/* page erase operations */
+	unsigned long writes;		/* page write operations */
+	unsigned long fills;		/* words loaded into page buffer */
+	unsigned long ee_writes;	/* EEPROM byte writes */
+	unsigned long app_starts;	/* jumps to the application */
+	unsigned long busy_errors;	/* flash or EEPROM access when busy */
+	unsigned long rww_errors;	/* reads of busy RWW section */
+	unsigned long rx_lost;		/* bytes lost by receiver */
+	unsigned long tx_lost;		/* bytes not shifted out */
+	unsigned long garbled;		/* bytes at wrong baud rate */
+	unsigned long timeouts;		/* answers not received */
+};
+
+extern unsigned char host_flash [HOST_FLASH_SIZE];
+extern unsigned char host_eeprom [HOST_EEPROM_SIZE];
+extern struct host_stats host_stats;
+extern unsigned char *host_output;
+extern size_t host_output_len;
+extern unsigned long host_lost_write;	/* number of page write to lose */
+
+/*
+ * Input is sent in chunks, as a host does: the bytes
+ * of a chunk, then wait for the given number of answer frames
+ * (at most host_timeout polls), then wait the given delay.
+ */
+struct host_chunk {
+	size_t len;			/* bytes of input */
+	unsigned answers;		/* answer frames to wait for */
+	unsigned long delay;		/* polls to wait after answers */
+	unsigned long baud;		/* rate of host, 0 for BAUDRATE */
+};
+
+/*
+ * Run the boot loader on given input chunks, until all
+ * of them are sent and answered. Answers are collected
+ * in host_output. Entry is warm, or cold as after reset.
+ */
+void host_run (const unsigned char *input, const struct host_chunk *chunk,
+	unsigned nchunks, int warmboot);
+
+/*
+ * Call a function as the application, between the runs:
+ * hardware is left as the boot loader has left it.
+ */
+void host_app (void (*func) (void));
+
+/*
+ * Run the boot loader (warm entry) on a file descriptor,
+ * for example master side of a pseudo-terminal, until the port
+ * is closed after use, or the application is started.
+ */
+void host_serve (int fd);
+
+int stkboot_main (int warmboot, char **dummy);
+unsigned short crc16 (unsigned short sum, unsigned char byte);
+
+/* FLASH_API and STAGING, for the application */
+unsigned char flash_erase (unsigned long addr);
+void flash_fill (unsigned short addr, unsigned short word);
+unsigned char flash_write (unsigned long addr);
+void flash_rww (void);
+unsigned char stage_write (unsigned long addr, const unsigned char *data);
@@ -0,0 +1,76 @@
+/*
+ * Mock AVR registers for host build of stkboot.
+ * Registers with hardware behind them (SPM control, EEPROM control,
+ * UART status and data, Timer1 counter) are reached through
+ * functions of host/mock.c: every access is a poll, which advances
+ * the emulated time. Other registers are plain variables.
+ */
+volatile unsigned char *host_spmcsr (void);
+volatile unsigned char *host_eecr (void);
+volatile unsigned char *host_ucsra (void);
+volatile unsigned short *host_udr (void);
+volatile unsigned short *host_tcnt1 (void);
+
+#define SPMCSR		(*host_spmcsr ())
+#define EECR		(*host_eecr ())
+#define UCSR0A		(*host_ucsra ())
+#define UDR		(*host_udr ())
+#define TCNT1		(*host_tcnt1 ())
+
+extern volatile unsigned char RAMPZ;
+extern volatile unsigned char UBRR0L, UBRR0H, UCSR0B, UCSR0C;
+extern volatile unsigned char WDTCR, MCUCR, GICR, TCCR1B;
+extern volatile unsigned char SREG;
+extern volatile unsigned char PORTD, DDRD;
+
+/* Registers checked by #ifdef in stkboot.c */
+#define RAMPZ		RAMPZ
+#define WDTCR		WDTCR
+
+/* SPMCSR */
+#define SPMEN		0
+#define PGERS		1
+#define PGWRT		2
+#define BLBSET		3
+#define RWWSRE		4
+#define RWWSB		6
+
+/* UCSR0A */
+#define MPCM		0
+#define U2X		1
+#define UDRE		5
+#define TXC		6
+#define RXC		7
+
+/* UCSR0B */
+#define TXEN		3
+#define RXEN		4
+#define RXCIE		7
+
+/* UCSR0C */
+#define UCSZ0		1
+
+/* WDTCR */
+#define WDE		3
+
+/* EECR */
+#define EERE		0
+#define EEWE		1
+#define EEMWE		2
+
+#define E2END		0x0FFF
+
+/* TCCR1B */
+#define CS10		0
+#define CS11		1
+#define CS12		2
+
+/* MCUCR */
+#define IVCE		0
+#define IVSEL		1
+
+/* SREG */
+#define SREG_I		7
+
+#define cli()		(SREG &= ~(1 << SREG_I))
+#define sei()		(SREG |= 1 << SREG_I)
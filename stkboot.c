@@ -40,6 +40,16 @@
 #define CONFIG_PARAM_OSC_PSCALE		2
 #define CONFIG_PARAM_OSC_CMATCH		1
 
+/*
+ * Nonstandard parameters.
+ */
+#define PARAM_BAUDRATE			0xC0	/* baud rate / 4800 */
+#define PARAM_EXT_PAGES			0xC1	/* pages per extended frame */
+#define PARAM_NODE_ADDR			0xC2	/* RS-485 node address */
+#define PARAM_NODE_STATUS		0xC3	/* failure of broadcast commands */
+#define PARAM_NODE_FRAMES		0xC4	/* broadcast frames processed */
+#define PARAM_PROFILE			0xD0	/* profiling counters */
+
 #define MSG_IDLE			0
 #define MSG_WAIT_SEQNUM			1
 #define MSG_WAIT_SIZE1			2
@@ -47,11 +57,44 @@
 #define MSG_WAIT_TOKEN			4
 #define MSG_WAIT_MSG			5
 #define MSG_WAIT_CKSUM			6
+#define MSG_WAIT_CKSUM2			7
+#define MSG_WAIT_NODE			8
+
+/*
+ * Extended frame: the same header with a different token,
+ * body up to EXT_PAGES flash pages, and CRC-16 of header and body
+ * instead of XOR checksum, high byte first. The answer is sent
+ * in the same format.
+ */
+#define TOKEN_EXT			(TOKEN | 0x80)
+
+/*
+ * Nonstandard commands.
+ */
+#define CMD_UPDATE_FLASH_ISP		(CMD_PROGRAM_FLASH_ISP | 0x80)
+#define CMD_CRC_FLASH_ISP		(CMD_READ_FLASH_ISP | 0x40)
+#define CMD_PROGRAM_PACKED_ISP		(CMD_PROGRAM_FLASH_ISP | 0x40)
+#define CMD_FILL_FLASH_ISP		(CMD_PROGRAM_FLASH_ISP | 0xC0)
+
+/*
+ * Nonstandard status: written data do not match flash contents.
+ */
+#define STATUS_VERIFY_FAILED		0xC2
 
 /*
  * Define various device id's
  */
-#if defined __AVR_ATmega128__
+#if defined __AVR_ATmega2560__
+#define SIG2		0x98
+#define SIG3		0x01
+#define PAGE_SIZE	0x80U	/* 128 words */
+
+#elif defined __AVR_ATmega1280__
+#define SIG2		0x97
+#define SIG3		0x03
+#define PAGE_SIZE	0x80U	/* 128 words */
+
+#elif defined __AVR_ATmega128__
 #define SIG2		0x97
 #define SIG3		0x02
 #define PAGE_SIZE	0x80U	/* 128 words */
@@ -110,14 +153,177 @@
 #define PAGE_SIZE	0x20U	/* 32 words */
 #endif
 
-unsigned char msg_buf [295];
+#define PAGE_BYTES	(PAGE_SIZE * 2)
+
+/*
+ * Newer chips have numbered USART registers and bits.
+ */
+#ifndef WDTCR
+#define WDTCR		WDTCSR
+#endif
+#ifndef UDR
+#define UDR		UDR0
+#endif
+#ifndef RXEN
+#define RXEN		RXEN0
+#define TXEN		TXEN0
+#define RXCIE		RXCIE0
+#define UCSZ0		UCSZ00
+#define UDRE		UDRE0
+#define TXC		TXC0
+#define RXC		RXC0
+#define U2X		U2X0
+#endif
+#ifndef EEWE
+#define EEWE		EEPE
+#define EEMWE		EEMPE
+#endif
+
+/*
+ * Staged image is written by flash functions for the application.
+ */
+#if defined STAGING && ! defined FLASH_API
+#define FLASH_API
+#endif
+
+/*
+ * Without lazy erase, all pages are erased by chip erase,
+ * and there is nothing to keep unchanged.
+ */
+#if defined INCREMENTAL && ! defined LAZY_ERASE
+#define LAZY_ERASE
+#endif
+
+/*
+ * Maximum length of message body.
+ */
+#ifdef EXT_FRAME
+#ifndef EXT_PAGES
+#define EXT_PAGES	4	/* flash pages per extended frame */
+#endif
+#define MSG_MAXLEN	(EXT_PAGES * PAGE_BYTES + 10)
+#define msg_limit()	(ext_frame ? MSG_MAXLEN : 280)
+#else
+#define MSG_MAXLEN	280
+#define msg_limit()	280
+#endif
+
+#ifdef RX_INTERRUPT
+/*
+ * Offset of receive interrupt vector, in bytes.
+ * The vector table is moved to the boot section.
+ */
+#if defined __AVR_ATmega2560__ || defined __AVR_ATmega1280__
+#define RX_VECTOR	0x64
+#define IVREG		MCUCR
+#elif defined __AVR_ATmega128__ || defined __AVR_ATmega64__
+#define RX_VECTOR	0x48
+#define IVREG		MCUCR
+#elif defined __AVR_ATmega32__
+#define RX_VECTOR	0x34
+#define IVREG		GICR
+#elif defined __AVR_ATmega16__
+#define RX_VECTOR	0x2C
+#define IVREG		GICR
+#else
+#error RX_INTERRUPT is not supported for this chip!
+#endif
+
+#ifndef RX_BUFSZ
+#define RX_BUFSZ	128	/* size of receive ring, power of 2 */
+#endif
+#endif
+
+#ifdef RS485
+/*
+ * Multi-drop bus: node address follows MESSAGE_START in every frame
+ * and answer. Address 0 is broadcast. The node address is kept
+ * in EEPROM. Transmitter of RS-485 driver is enabled by DE pin.
+ */
+#define NODE_BROADCAST	0x00
+#ifndef NODE_EEADDR
+#define NODE_EEADDR	E2END
+#endif
+#ifndef DE_PORT
+#define DE_PORT		PORTD
+#define DE_DDR		DDRD
+#define DE_BIT		2
+#endif
+#endif
+
+unsigned char msg_buf [MSG_MAXLEN + 15];
 unsigned short nbytes;
 unsigned short word0;
 unsigned char chip_erased;
 unsigned char param_sck_duration;
 unsigned char param_reset_polarity;
 unsigned char param_controller_init;
-unsigned short poly_tab [16];
+#ifdef EXT_FRAME
+unsigned char ext_frame;		/* last frame is extended */
+unsigned short tx_crc;
+#endif
+unsigned char tx_cksum;
+#ifdef STREAM_FILL
+unsigned short filled;			/* bytes in page buffer, loaded
+					 * while receiving */
+#endif
+#ifdef RX_INTERRUPT
+unsigned char rx_buf [RX_BUFSZ];
+volatile unsigned char rx_head, rx_tail;
+#endif
+#ifdef POSTED_WRITE
+unsigned char rww_busy;
+#endif
+#ifdef LEAVE_START
+unsigned char app_go;			/* start application after answer */
+#endif
+#ifdef RS485
+unsigned char node_addr;		/* address of this node */
+unsigned char node_dest;		/* address of current frame */
+unsigned char node_status;		/* first failure of broadcast commands */
+unsigned char node_frames;		/* broadcast frames processed */
+#endif
+#ifdef BAUD_SWITCH
+unsigned char param_baudrate;
+unsigned char baud_change;		/* 1 - normal, 2 - double speed */
+unsigned short baud_ubrr;
+unsigned char baud_trial;		/* trying new baud rate */
+unsigned short baud_stamp;		/* Timer1 at last check */
+unsigned long baud_ticks;		/* Timer1 ticks at new baud rate */
+#endif
+#ifdef LAZY_ERASE
+unsigned char erase_map [(BADDR / PAGE_BYTES + 7) / 8];
+#endif
+#ifdef EEPROM
+/*
+ * Queue of EEPROM writes, done in background while waiting for input.
+ */
+#ifndef EE_QSIZE
+#define EE_QSIZE	64	/* size of write queue, power of 2 */
+#endif
+unsigned short ee_qaddr [EE_QSIZE];
+unsigned char ee_qdata [EE_QSIZE];
+unsigned char ee_head, ee_tail;
+unsigned short ee_wipe;			/* next address to erase */
+unsigned char ee_done [(E2END + 8) / 8]; /* bytes written while erasing */
+#endif
+#ifdef PROFILE
+/*
+ * Time is accounted in ticks of Timer1 (clock / 8)
+ * to one of these states.
+ */
+#define PROF_PARSE	0	/* frame parser, answers */
+#define PROF_CMD	1	/* program_cmd() */
+#define PROF_RX		2	/* waiting in uart_getchar() */
+#define PROF_TX		3	/* waiting in uart_putchar() */
+#define PROF_SPM	4	/* waiting for spm or eeprom writes */
+#define PROF_NSTATES	5
+
+unsigned long prof_count [PROF_NSTATES];
+unsigned long prof_latch [PROF_NSTATES];
+unsigned short prof_stamp;
+unsigned char prof_state;
+#endif
 
 union {
 	unsigned long dword;
@@ -131,13 +337,53 @@ union {
 void uart_init (void);
 void uart_putchar (char c);
 unsigned char uart_getchar (void);
-unsigned short program_cmd (void);
+void uart_flush (void);
+void uart_switch (void);
+unsigned char baud_select (unsigned char code);
+unsigned short program_cmd (unsigned char seqnum, unsigned short len);
 void transmit_answer (unsigned char seqnum, unsigned short len);
+void tx_begin (unsigned char seqnum, unsigned short len);
+void tx_byte (unsigned char c);
+void tx_end (void);
 void page_erase (unsigned long addr);
-void page_write (void);
+unsigned char page_write (void);
+void page_begin (void);
+void page_fill (unsigned short addr, unsigned short word);
+void page_commit (void);
+unsigned short page_unpack (unsigned short len, unsigned char fill);
 unsigned char read_byte (void);
 unsigned short crc16 (unsigned short sum, unsigned char byte);
-
+void flash_sync (void);
+unsigned char page_blank (unsigned long addr);
+unsigned char erase_pending (unsigned long addr);
+unsigned char page_differs (void);
+void prof_switch (unsigned char state);
+void prof_clear (void);
+unsigned char ee_read (unsigned short addr);
+void ee_start (unsigned short addr, unsigned char data);
+void ee_queue (unsigned short addr, unsigned char data);
+void ee_poll (void);
+void ee_sync (unsigned char all);
+void ee_erase (void);
+unsigned char ee_get (unsigned short addr);
+void stream_fill (unsigned short offset, unsigned short msglen);
+void node_broadcast (unsigned char seqnum, unsigned short msglen);
+void stream_cancel (void);
+unsigned char entry_sync (void);
+void app_start (void);
+void api_spm (unsigned char cmd, unsigned long addr, unsigned short word);
+unsigned char flash_erase (unsigned long addr) __attribute__ ((used));
+void flash_fill (unsigned short addr, unsigned short word)
+	__attribute__ ((used));
+unsigned char flash_write (unsigned long addr) __attribute__ ((used));
+void flash_rww (void) __attribute__ ((used));
+unsigned char stage_write (unsigned long addr, const unsigned char *data)
+	__attribute__ ((used));
+unsigned char stage_byte (unsigned long addr);
+unsigned char stage_valid (void);
+void stage_commit (void);
+
+#ifdef __AVR__
 /*
  * Load a byte from the program memory (flash).
  */
@@ -172,6 +418,89 @@ unsigned short crc16 (unsigned short sum, unsigned char byte);
 		"movw r0,%0" 				\
 		: : "r" ((short)word) : "r0", "r1")
 
+#define clear_zero_reg()	asm volatile ("clr __zero_reg__")
+#define watchdog_reset()	asm volatile ("wdr")
+#else
+/*
+ * Host build: flash memory, spm instruction and registers
+ * are emulated, see host/mock.c.
+ */
+extern unsigned short host_r0r1;
+unsigned char host_lpm (unsigned char rampz, unsigned short addr);
+void host_spm (unsigned short addr);
+unsigned char host_rx_ready (unsigned char ready);
+
+#define lpm(addr)		host_lpm (0, (unsigned short) (addr))
+#define elpm(addr)		host_lpm (RAMPZ, (unsigned short) (addr))
+#define spm(addr)		host_spm ((unsigned short) (addr))
+#define load_r0r1(word)		(host_r0r1 = (word))
+#define clear_zero_reg()	/* empty */
+#define watchdog_reset()	/* empty */
+#endif
+
+/*
+ * Read a byte of flash. On chips with more than 64 kbytes
+ * the segment is selected by RAMPZ.
+ */
+#ifdef RAMPZ
+#define flash_read(addr)	elpm (addr)
+#else
+#define flash_read(addr)	lpm (addr)
+#endif
+
+#ifdef PROFILE
+/*
+ * Account a wait to its own state, then return
+ * to the state of the caller.
+ */
+#define prof_enter(state)	unsigned char prof_prev = prof_state; \
+				prof_switch (state)
+#define prof_leave()		prof_switch (prof_prev)
+#else
+#define prof_switch(state)	/* empty */
+#define prof_enter(state)	/* empty */
+#define prof_leave()		/* empty */
+#endif
+
+/*
+ * EEPROM write in progress blocks flash programming.
+ */
+#define ee_busy()		(EECR & (1 << EEWE))
+#ifdef EEPROM
+#define ee_wait()		while (ee_busy ()) continue
+#else
+#define ee_wait()		/* empty */
+#endif
+
+/*
+ * Start SPM operation. The spm instruction must follow
+ * the SPMCR write within four cycles, so no interrupts here.
+ */
+#ifdef RX_INTERRUPT
+#define spm_cmd(cmd, addr) {				\
+	ee_wait ();					\
+	cli ();						\
+	SPMCR = (cmd);					\
+	spm (addr);					\
+	sei (); }
+#else
+#define spm_cmd(cmd, addr) {				\
+	ee_wait ();					\
+	SPMCR = (cmd);					\
+	spm (addr); }
+#endif
+
+/*
+ * Wait for SPM operation to complete.
+ */
+#define spm_wait() {					\
+	prof_enter (PROF_SPM);				\
+	while (SPMCR & (1 << SPMEN)) {			\
+		prof_switch (PROF_SPM);			\
+	}						\
+	prof_leave (); }
+
+#ifdef __AVR__
 /*
  * Start here on reset.
  */
@@ -183,33 +512,92 @@ asm ("ldi r25, 0");
  */
 asm ("jmp main");
 
+#ifdef FLASH_API
+/*
+ * Table of functions for user program, from BADDR+8.
+ * Entries are at fixed addresses with any options.
+ */
+asm ("jmp stage_write");
+asm ("jmp flash_erase");
+asm ("jmp flash_fill");
+asm ("jmp flash_write");
+asm ("jmp flash_rww");
+#endif
+
+#ifdef RX_INTERRUPT
+/*
+ * Receive interrupt vector, relative to the boot section start.
+ */
+#define STRINGIFY(x)	#x
+#define ORG(x)		".org " STRINGIFY(x)
+asm (ORG (RX_VECTOR));
+asm ("jmp __vector_uart_rx");
+#endif
+#endif /* __AVR__ */
+
 int main (int warmboot, char **dummy)
 {
 	unsigned char ch, msgparsestate, cksum, seqnum;
 	unsigned short msglen, i;
+#ifdef EXT_FRAME
+	unsigned short crc;
+	unsigned char crc_ok;
+#endif
 
 	/* Disable interrupts */
 	cli ();
 
 	/* Clear zero register */
-	asm volatile ("clr __zero_reg__");
+	clear_zero_reg ();
 
 	/* On cold boot, if memory is not empty - start from 0 */
-	if (! warmboot && lpm(0) != 0xFF)
-		((void (*) ()) 0) ();
+	if (! warmboot && lpm(0) != 0xFF) {
+#ifdef STAGING
+		/* Unless staged image is to be copied */
+		if (! stage_valid ())
+#endif
+#ifdef ENTRY_WINDOW
+		/* Unless the host asks to stay in boot loader */
+		if (! entry_sync ())
+#endif
+			app_start ();
+	}
 
 	/* Disable watchdog */
-	asm volatile ("wdr");
+	watchdog_reset ();
 	WDTCR = 3 << WDE;
 	WDTCR = 0;
 
 	uart_init ();
+#ifdef RX_INTERRUPT
+	/* Memory is not cleared at startup */
+	rx_head = 0;
+	rx_tail = 0;
+
+	/* Move interrupt vectors to the boot section */
+	IVREG = 1 << IVCE;
+	IVREG = 1 << IVSEL;
+	sei ();
+#endif
+#ifdef PROFILE
+	/* Before the greeting, which is accounted */
+	prof_state = PROF_PARSE;
+	prof_clear ();
+	for (i=0; i<PROF_NSTATES; ++i)
+		prof_latch[i] = 0;
+#endif
+#ifdef RS485
+	/* Driver in receive mode, no greeting on a shared bus */
+	DE_PORT &= ~(1 << DE_BIT);
+	DE_DDR |= 1 << DE_BIT;
+#else
 	uart_putchar ('B');
 	uart_putchar ('o');
 	uart_putchar ('o');
 	uart_putchar ('t');
 	uart_putchar ('\r');
 	uart_putchar ('\n');
+#endif
 
 	/* Initialize global variables */
 	param_sck_duration = 0;
@@ -218,36 +606,83 @@ int main (int warmboot, char **dummy)
 	address.dword = 0;
 	chip_erased = 0;
 	word0 = 0xFFFF;
-	poly_tab [0] = 0x0000;
-        poly_tab [1] = 0xCC01;
-        poly_tab [2] = 0xD801;
-        poly_tab [3] = 0x1400;
-        poly_tab [4] = 0xF001;
-        poly_tab [5] = 0x3C00;
-        poly_tab [6] = 0x2800;
-        poly_tab [7] = 0xE401;
-        poly_tab [8] = 0xA001;
-        poly_tab [9] = 0x6C00;
-        poly_tab [10] = 0x7800;
-        poly_tab [11] = 0xB401;
-        poly_tab [12] = 0x5000;
-        poly_tab [13] = 0x9C01;
-        poly_tab [14] = 0x8801;
-        poly_tab [15] = 0x4400;
+#ifdef EXT_FRAME
+	ext_frame = 0;
+#endif
+#ifdef STREAM_FILL
+	filled = 0;
+#endif
+#ifdef POSTED_WRITE
+	rww_busy = 0;
+#endif
+#ifdef LEAVE_START
+	app_go = 0;
+#endif
+#ifdef RS485
+	node_addr = ee_read (NODE_EEADDR);
+	if (node_addr == NODE_BROADCAST)
+		node_addr = 0xFF;
+	node_dest = NODE_BROADCAST;
+	node_status = 0;
+	node_frames = 0;
+#endif
+#ifdef LAZY_ERASE
+	for (i=0; i<sizeof (erase_map); ++i)
+		erase_map[i] = 0;
+#endif
+#ifdef EEPROM
+	ee_head = 0;
+	ee_tail = 0;
+	ee_wipe = E2END + 1;
+#endif
+#ifdef BAUD_SWITCH
+	param_baudrate = BAUDRATE / 4800;
+	baud_change = 0;
+	baud_trial = 0;
+#endif
+#ifdef STAGING
+	if (stage_valid ()) {
+		/* New image is staged by the application */
+		stage_commit ();
+		app_start ();
+	}
+#endif
 
 	msgparsestate = MSG_IDLE;
 	msglen = 0;
 	seqnum = 0;
 	i = 0;
 	cksum = 0;
+#ifdef EXT_FRAME
+	crc = 0;
+	crc_ok = 0;
+#endif
 	while (1) {
 		ch = uart_getchar ();
 		/* parse message according to appl. note AVR068 table 3-1: */
 		if (msgparsestate == MSG_IDLE && ch == MESSAGE_START) {
+#ifdef RS485
+			msgparsestate = MSG_WAIT_NODE;
+#else
 			msgparsestate = MSG_WAIT_SEQNUM;
+#endif
 			cksum = ch ^ 0;
+#ifdef STREAM_FILL
+			if (filled != 0) {
+				/* Previous frame was rejected */
+				stream_cancel ();
+			}
+#endif
+			continue;
+		}
+#ifdef RS485
+		if (msgparsestate == MSG_WAIT_NODE) {
+			node_dest = ch;
+			cksum ^= ch;
+			msgparsestate = MSG_WAIT_SEQNUM;
 			continue;
 		}
+#endif
 		if (msgparsestate == MSG_WAIT_SEQNUM) {
 			seqnum = ch;
 			cksum ^= ch;
@@ -271,30 +706,104 @@ int main (int warmboot, char **dummy)
 			if (ch == TOKEN) {
 				msgparsestate = MSG_WAIT_MSG;
 				i = 0;
+#ifdef EXT_FRAME
+				ext_frame = 0;
+			} else if (ch == TOKEN_EXT) {
+				msgparsestate = MSG_WAIT_MSG;
+				i = 0;
+				ext_frame = 1;
+				crc = crc16 (0, MESSAGE_START);
+#ifdef RS485
+				crc = crc16 (crc, node_dest);
+#endif
+				crc = crc16 (crc, seqnum);
+				crc = crc16 (crc, msglen >> 8);
+				crc = crc16 (crc, msglen);
+				crc = crc16 (crc, TOKEN_EXT);
+#endif
 			} else {
 				msgparsestate = MSG_IDLE;
 			}
 			continue;
 		}
-		if (msgparsestate == MSG_WAIT_MSG && i < msglen && i < 280) {
+		if (msgparsestate == MSG_WAIT_MSG && i < msglen &&
+		    i < msg_limit ()) {
 			cksum ^= ch;
+#ifdef EXT_FRAME
+			if (ext_frame)
+				crc = crc16 (crc, ch);
+#endif
 			msg_buf[i] = ch;
 			i++;
+#ifdef STREAM_FILL
+			if (i >= 12 && ! (i & 1)) {
+				/* Next word of data is received */
+				stream_fill (i - 12, msglen);
+			}
+#endif
 			if (i == msglen) {
 				msgparsestate = MSG_WAIT_CKSUM;
 			}
 			continue;
 		}
+#ifdef EXT_FRAME
+		if (msgparsestate == MSG_WAIT_CKSUM && ext_frame) {
+			/* High byte of CRC, low byte follows */
+			crc_ok = (ch == (unsigned char) (crc >> 8));
+			msgparsestate = MSG_WAIT_CKSUM2;
+			continue;
+		}
+		if (msgparsestate == MSG_WAIT_CKSUM2) {
+			/* Turn the result into XOR check below */
+			if (crc_ok && ch == (unsigned char) crc)
+				ch = cksum;
+			else
+				ch = ~cksum;
+			msgparsestate = MSG_WAIT_CKSUM;
+		}
+#endif
+#ifdef RS485
+		if (msgparsestate == MSG_WAIT_CKSUM && node_dest != node_addr) {
+			/* Broadcast or another node: no answer */
+			if (node_dest == NODE_BROADCAST &&
+			    ch == cksum && msglen > 0)
+				node_broadcast (seqnum, msglen);
+		} else
+#endif
 		if (msgparsestate == MSG_WAIT_CKSUM) {
 			if (ch == cksum && msglen > 0) {
 				/* message correct, process it */
-				msglen = program_cmd ();
+#ifdef BAUD_SWITCH
+				baud_trial = 0;
+#endif
+				prof_switch (PROF_CMD);
+				msglen = program_cmd (seqnum, msglen);
+				prof_switch (PROF_PARSE);
 			} else {
 				msg_buf[0] = ANSWER_CKSUM_ERROR;
 				msg_buf[1] = STATUS_CKSUM_ERROR;
 				msglen = 2;
 			}
-			transmit_answer (seqnum, msglen);
+			if (msglen > 0) {
+				/* Otherwise the answer is already sent */
+				transmit_answer (seqnum, msglen);
+			}
+#ifdef BAUD_SWITCH
+			if (baud_change) {
+				/* Answer is sent at old rate, now switch. */
+				uart_switch ();
+			}
+#endif
+#ifdef LEAVE_START
+			if (app_go) {
+				/* Wait until the answer is shifted out */
+				uart_flush ();
+#ifdef EEPROM
+				ee_sync (1);
+#endif
+				app_start ();
+			}
+#endif
 			/* no continue here, set state=MSG_IDLE */
 		}
 		msgparsestate = MSG_IDLE;
@@ -311,36 +820,73 @@ int main (int warmboot, char **dummy)
  */
 void transmit_answer (unsigned char seqnum, unsigned short len)
 {
-	unsigned char cksum;
-	unsigned char ch;
 	unsigned short i;
 
-	if (len > 285 || len < 1) {
+	if (len > MSG_MAXLEN + 5 || len < 1) {
 		/* software error */
 		len = 2;
 		/* msg_buf[0]: not changed */
 		msg_buf[1] = STATUS_CMD_FAILED;
 	}
-	uart_putchar (MESSAGE_START);	/* 0x1B */
-	cksum = MESSAGE_START ^ 0;
-	uart_putchar (seqnum);
-	cksum ^= seqnum;
-	ch = (len >> 8) & 0xFF;
-	uart_putchar (ch);
-	cksum ^= ch;
-	ch = len & 0xFF;
-	uart_putchar (ch);
-	cksum ^= ch;
-	uart_putchar (TOKEN);	/* 0x0E */
-	cksum ^= TOKEN;
-	for (i = 0; i < len; i++) {
-		uart_putchar (msg_buf[i]);
-		cksum ^= msg_buf[i];
+	tx_begin (seqnum, len);
+	for (i = 0; i < len; i++)
+		tx_byte (msg_buf[i]);
+	tx_end ();
+}
+
+/*
+ * Send header of the answer, with given length of the body.
+ * The body is sent by tx_byte(), and the checksum by tx_end().
+ */
+void tx_begin (unsigned char seqnum, unsigned short len)
+{
+	tx_cksum = 0;
+#ifdef EXT_FRAME
+	tx_crc = 0;
+#endif
+	tx_byte (MESSAGE_START);	/* 0x1B */
+#ifdef RS485
+	tx_byte (node_dest);
+#endif
+	tx_byte (seqnum);
+	tx_byte (len >> 8);
+	tx_byte (len);
+#ifdef EXT_FRAME
+	if (ext_frame) {
+		tx_byte (TOKEN_EXT);
+		return;
 	}
-	uart_putchar (cksum);
+#endif
+	tx_byte (TOKEN);		/* 0x0E */
+}
+
+void tx_byte (unsigned char c)
+{
+	uart_putchar (c);
+	tx_cksum ^= c;
+#ifdef EXT_FRAME
+	if (ext_frame)
+		tx_crc = crc16 (tx_crc, c);
+#endif
+}
+
+void tx_end ()
+{
+#ifdef EXT_FRAME
+	if (ext_frame) {
+		uart_putchar (tx_crc >> 8);
+		uart_putchar (tx_crc);
+	} else
+#endif
+	uart_putchar (tx_cksum);
+#ifdef RS485
+	/* Release the bus after the last byte */
+	uart_flush ();
+	DE_PORT &= ~(1 << DE_BIT);
+#endif
 }
 
-unsigned short program_cmd ()
+unsigned short program_cmd (unsigned char seqnum, unsigned short len)
 {
 	if (msg_buf[0] == CMD_SIGN_ON) {
 		/* prepare answer: */
@@ -372,6 +918,41 @@ unsigned short program_cmd ()
 		} else if (msg_buf[1] == PARAM_CONTROLLER_INIT) {
 			param_controller_init = msg_buf[2];
 		}
+#ifdef RS485
+		else if (msg_buf[1] == PARAM_NODE_ADDR) {
+			/* Stored in EEPROM, used from the next frame */
+			if (msg_buf[2] == NODE_BROADCAST)
+				goto failed;
+#ifdef POSTED_WRITE
+			flash_sync ();
+#endif
+			while (ee_busy ())
+				continue;
+			ee_start (NODE_EEADDR, msg_buf[2]);
+			node_addr = msg_buf[2];
+		}
+#endif
+#ifdef BAUD_SWITCH
+		else if (msg_buf[1] == PARAM_BAUDRATE) {
+			/* Switch after the answer is sent */
+			if (! baud_select (msg_buf[2]))
+				goto failed;
+		}
+#endif
+#ifdef PROFILE
+		else if (msg_buf[1] == PARAM_PROFILE) {
+			/* 0 - clear counters, 1 - latch for reading */
+			if (msg_buf[2] == 0) {
+				prof_clear ();
+			} else {
+				unsigned char i;
+
+				prof_switch (PROF_CMD);
+				for (i=0; i<PROF_NSTATES; ++i)
+					prof_latch[i] = prof_count[i];
+			}
+		}
+#endif
 ok:		msg_buf[1] = STATUS_CMD_OK;
 		return 2;
 
@@ -394,6 +975,30 @@ ok:		msg_buf[1] = STATUS_CMD_OK;
 			n = param_reset_polarity;
 		else if (msg_buf[1] == PARAM_CONTROLLER_INIT)
 			n = param_controller_init;
+#ifdef BAUD_SWITCH
+		else if (msg_buf[1] == PARAM_BAUDRATE)
+			n = param_baudrate;
+#endif
+#ifdef EXT_FRAME
+		else if (msg_buf[1] == PARAM_EXT_PAGES)
+			n = EXT_PAGES;
+#endif
+#ifdef RS485
+		else if (msg_buf[1] == PARAM_NODE_ADDR)
+			n = node_addr;
+		else if (msg_buf[1] == PARAM_NODE_STATUS)
+			n = node_status;
+		else if (msg_buf[1] == PARAM_NODE_FRAMES)
+			n = node_frames;
+#endif
+#ifdef PROFILE
+		else if (msg_buf[1] >= PARAM_PROFILE &&
+		    msg_buf[1] < PARAM_PROFILE + 4*PROF_NSTATES) {
+			/* Latched counter, low byte first */
+			n = msg_buf[1] - PARAM_PROFILE;
+			n = prof_latch [n >> 2] >> (8 * (n & 3));
+		}
+#endif
 #if 1
 		else if (msg_buf[1] == PARAM_VTARGET)
 			n = CONFIG_PARAM_VTARGET;
@@ -418,19 +1023,115 @@ failed:		msg_buf[1] = STATUS_CMD_FAILED;
 		return 2;
 
 	} else if (msg_buf[0] == CMD_CHIP_ERASE_ISP) {
+#ifdef LAZY_ERASE
+		unsigned char i;
+
+		/* Do not erase right now, just mark all pages.
+		 * Every page is erased before its first write,
+		 * and the rest on LEAVE_PROGMODE command.
+		 * Page 0 is erased at once: when the session
+		 * is broken, no half-old image is started. */
+		for (i=0; i<sizeof (erase_map); ++i)
+			erase_map[i] = 0xFF;
+		page_erase (0);
+#ifdef EEPROM
+		ee_erase ();
+#endif
+		chip_erased = 1;
+		word0 = 0xFFFF;
+		goto ok;
+#else
 		unsigned long addr;
+#ifdef BLANK_CHECK
+		unsigned short count;
 
-		for (addr=0; addr<BADDR; addr+=PAGE_SIZE)
+#ifdef POSTED_WRITE
+		flash_sync ();
+#endif
+		count = 0;
+#endif
+		for (addr=0; addr<BADDR; addr+=PAGE_BYTES) {
+#ifdef BLANK_CHECK
+			/* Skip pages which are already empty */
+			if (page_blank (addr))
+				continue;
+			++count;
+#endif
 			page_erase (addr);
+		}
+#ifdef EEPROM
+		/* EEPROM is erased in background */
+		ee_erase ();
+#endif
 		chip_erased = 1;
 		word0 = 0xFFFF;
+#ifdef BLANK_CHECK
+		/* Report the number of pages actually erased */
+		msg_buf[1] = STATUS_CMD_OK;
+		msg_buf[2] = count >> 8;
+		msg_buf[3] = count;
+		return 4;
+#else
 		goto ok;
+#endif
+#endif /* LAZY_ERASE */
 
 	} else if (msg_buf[0] == CMD_PROGRAM_EEPROM_ISP) {
+#ifdef EEPROM
+		/* Same format as CMD_PROGRAM_FLASH_ISP.
+		 * Byte address is given by CMD_LOAD_ADDRESS.
+		 * Bytes are queued and written in background,
+		 * while next frames are received. */
+		unsigned short i;
+
+		nbytes = (unsigned short) msg_buf[1] << 8 | msg_buf[2];
+		if (nbytes > MSG_MAXLEN - 10 || nbytes + 10 > len) {
+			/* corrupted message, or data are not received */
+			goto failed;
+		}
+		if ((address.dword >> 1) + nbytes > E2END + 1) {
+			/* beyond the end of EEPROM */
+			goto failed;
+		}
+		for (i=0; i<nbytes; ++i) {
+			ee_queue (address.dword >> 1, msg_buf [10 + i]);
+			address.dword += 2;
+		}
+		goto ok;
+#else
 		goto failed;
+#endif
 
 	} else if (msg_buf[0] == CMD_READ_EEPROM_ISP) {
+#ifdef EEPROM
+		unsigned short i;
+
+		if (! chip_erased) {
+			/* Reading memory is permitted only after chip erase. */
+			goto failed;
+		}
+		nbytes = (unsigned short) msg_buf[1] << 8 | msg_buf[2];
+		if (nbytes > msg_limit ()) {
+			/* limit answer len, prevent overflow: */
+			nbytes = msg_limit ();
+		}
+		if ((address.dword >> 1) + nbytes > E2END + 1) {
+			/* beyond the end of EEPROM */
+			goto failed;
+		}
+		tx_begin (seqnum, nbytes + 3);
+		tx_byte (CMD_READ_EEPROM_ISP);
+		tx_byte (STATUS_CMD_OK);
+		for (i=0; i<nbytes; ++i) {
+			tx_byte (ee_get (address.dword >> 1));
+			address.dword += 2;
+		}
+		tx_byte (STATUS_CMD_OK);
+		tx_end ();
+		return 0;
+#else
 		goto failed;
+#endif
 
 	} else if (msg_buf[0] == CMD_PROGRAM_LOCK_ISP ||
 	    msg_buf[0] == CMD_PROGRAM_FUSE_ISP) {
@@ -484,12 +1185,34 @@ failed:		msg_buf[1] = STATUS_CMD_FAILED;
 
 	} else if (msg_buf[0] == CMD_LEAVE_PROGMODE_ISP) {
 		unsigned short i;
+#ifdef LAZY_ERASE
+		unsigned long addr;
+#endif
 
+#ifdef POSTED_WRITE
+		flash_sync ();
+#endif
+#ifdef EEPROM
+		/* Queued writes only: the erase goes on in background */
+		ee_sync (0);
+#endif
+#ifdef LAZY_ERASE
+		/* Erase pages, not touched by this session. */
+		for (addr=0; addr<BADDR; addr+=PAGE_BYTES) {
+			if (! erase_pending (addr))
+				continue;
+#ifdef BLANK_CHECK
+			if (page_blank (addr))
+				continue;
+#endif
+			page_erase (addr);
+		}
+#endif
 		if (word0 != 0xFFFF) {
 			/* Write word0 to address 0. */
 			address.dword = 0;
 			nbytes = PAGE_SIZE;
-#if defined __AVR_ATmega128__
+#ifdef RAMPZ
 			RAMPZ = 0;
 #endif
 			for (i=2; i<PAGE_SIZE; ++i) {
@@ -497,9 +1220,26 @@ failed:		msg_buf[1] = STATUS_CMD_FAILED;
 			}
 			msg_buf[10] = word0;
 			msg_buf[11] = word0 >> 8;
+#ifdef VERIFY
+			if (page_write () && chip_erased)
+				goto mismatch;
+#else
 			page_write ();
+#endif
 		}
+#ifdef POSTED_WRITE
+		flash_sync ();
+#endif
+#ifdef LEAVE_START
+		/* Start the application after the answer,
+		 * when there is one. */
+		app_go = (lpm (0) != 0xFF);
+		msg_buf[1] = STATUS_CMD_OK;
+		msg_buf[2] = app_go;
+		return 3;
+#else
 		goto ok;
+#endif
 
 	} else if (msg_buf[0] == CMD_LOAD_ADDRESS) {
 		address.byte[3] = msg_buf[1];
@@ -512,7 +1252,6 @@ failed:		msg_buf[1] = STATUS_CMD_FAILED;
 	} else if (msg_buf[0] == CMD_READ_FLASH_ISP ||
 	    msg_buf[0] == (CMD_READ_FLASH_ISP | 0x80)) {
 		unsigned short i, sum;
-		unsigned char byte;
 
 		if (! chip_erased) {
 			/* Reading memory is permitted only after chip erase. */
@@ -520,36 +1259,39 @@ failed:		msg_buf[1] = STATUS_CMD_FAILED;
 		}
 		/* msg_buf[1] and msg_buf[2] NumBytes msg_buf[3] cmd */
 		nbytes = (unsigned short) msg_buf[1] << 8 | msg_buf[2];
-		if (nbytes > 280) {
+		if (nbytes > msg_limit ()) {
 			/* limit answer len, prevent overflow: */
-			nbytes = 280;
+			nbytes = msg_limit ();
 		}
-#if defined __AVR_ATmega128__
-		if (address.word.high != 0)
-			RAMPZ = 1;
-		else
-			RAMPZ = 0;
+#ifdef POSTED_WRITE
+		flash_sync ();
 #endif
+		if (msg_buf[0] == CMD_READ_FLASH_ISP) {
+			/* Stream data from flash right into UART,
+			 * no copy in msg_buf. Next byte is fetched
+			 * while the previous one is shifted out. */
+			tx_begin (seqnum, nbytes + 3);
+			tx_byte (CMD_READ_FLASH_ISP);
+			tx_byte (STATUS_CMD_OK);
+			for (i=0; i<nbytes; ++i) {
+				tx_byte (read_byte ());
+				++address.dword;
+			}
+			tx_byte (STATUS_CMD_OK);
+			tx_end ();
+			return 0;
+		}
+		/* Nonstandard command: get memory checksum.
+		 * Use CRC-16 (x16 + x15 + x2 + 1). */
 		sum = 0;
 		for (i=0; i<nbytes; ++i) {
-			byte = read_byte ();
-			msg_buf [i + 2] = byte;
-			sum = crc16 (sum, byte);
-			sum = crc16 (sum, byte >> 4);
+			sum = crc16 (sum, read_byte ());
 			++address.dword;
 		}
-		if (msg_buf[0] == (CMD_READ_FLASH_ISP | 0x80)) {
-			/* Nonstandard command: get memory checksum.
-			 * Use CRC-16 (x16 + x5 + x2 + 1). */
-			msg_buf[1] = STATUS_CMD_OK;
-			msg_buf[2] = sum >> 8;
-			msg_buf[3] = sum;
-			return 4;
-		} else {
-			msg_buf[1] = STATUS_CMD_OK;
-			msg_buf[nbytes + 2] = STATUS_CMD_OK;
-			return nbytes + 3;
-		}
+		msg_buf[1] = STATUS_CMD_OK;
+		msg_buf[2] = sum >> 8;
+		msg_buf[3] = sum;
+		return 4;
 
 	} else if (msg_buf[0] == CMD_PROGRAM_FLASH_ISP) {
 		/* msg_buf[0] CMD_PROGRAM_FLASH_ISP
@@ -563,9 +1305,16 @@ failed:		msg_buf[1] = STATUS_CMD_FAILED;
 		 * msg_buf[8] poll1 (value to poll)
 		 * msg_buf[9] poll2
 		 * msg_buf[n+10] Data */
+#ifdef CRC_RANGE
+		if (! chip_erased) {
+			/* Otherwise clearing bits of a page and comparing
+			 * checksums would reveal its contents. */
+			goto failed;
+		}
+#endif
 		nbytes = (unsigned short) msg_buf[1] << 8 | msg_buf[2];
-		if (nbytes > 280) {
-			/* corrupted message */
+		if (nbytes > MSG_MAXLEN - 10 || nbytes + 10 > len) {
+			/* corrupted message, or data are not received */
 			goto failed;
 		}
 		if (address.dword == 0) {
@@ -576,10 +1325,173 @@ failed:		msg_buf[1] = STATUS_CMD_FAILED;
 			msg_buf[10] = 0xFF;
 			msg_buf[11] = 0xFF;
 		}
-		page_write ();
-		address.dword += nbytes;
+#ifdef VERIFY
+		if (page_write () && chip_erased) {
+			/* Reported only after chip erase: otherwise
+			 * the status would reveal flash contents. */
+mismatch:		msg_buf[1] = STATUS_VERIFY_FAILED;
+			return 2;
+		}
+#else
+		page_write ();
+#endif
 		goto ok;
 
+#ifdef INCREMENTAL
+	} else if (msg_buf[0] == CMD_UPDATE_FLASH_ISP) {
+		/* Nonstandard command: update one full page.
+		 * Same format as CMD_PROGRAM_FLASH_ISP.
+		 * The page is erased and written only when the data
+		 * differ from flash contents. The answer is the same
+		 * in both cases, so nothing is revealed about flash. */
+		if (! chip_erased) {
+			/* Otherwise any page could be replaced
+			 * by code, which reads out the rest. */
+			goto failed;
+		}
+		nbytes = (unsigned short) msg_buf[1] << 8 | msg_buf[2];
+		if (nbytes != PAGE_BYTES || nbytes + 10 > len ||
+		    (address.word.low & (PAGE_BYTES - 1)) != 0 ||
+		    address.dword >= BADDR) {
+			/* only aligned full pages below boot section */
+			goto failed;
+		}
+#ifdef POSTED_WRITE
+		flash_sync ();
+#endif
+		if (page_differs ()) {
+			if (address.dword == 0) {
+				/* Keep the page bootable only after
+				 * LEAVE_PROGMODE command. */
+				word0 = *(short*) (msg_buf + 10);
+				msg_buf[10] = 0xFF;
+				msg_buf[11] = 0xFF;
+			}
+			page_erase (address.dword);
+#ifdef VERIFY
+			/* Page is erased, nothing is revealed */
+			if (page_write ())
+				goto mismatch;
+#else
+			page_write ();
+#endif
+		} else {
+			address.dword += nbytes;
+		}
+		goto ok;
+#endif
+#ifdef PACKED
+	} else if (msg_buf[0] == CMD_PROGRAM_PACKED_ISP) {
+		/* Nonstandard command: program flash with packed data.
+		 * Same header as CMD_PROGRAM_FLASH_ISP, NumBytes
+		 * is the unpacked size, up to the end of page.
+		 * msg_buf[10..len-1] Packed data */
+#ifdef CRC_RANGE
+		if (! chip_erased)
+			goto failed;
+#endif
+		nbytes = (unsigned short) msg_buf[1] << 8 | msg_buf[2];
+		if (nbytes > PAGE_BYTES || (nbytes & 1) ||
+		    (address.word.low & (PAGE_BYTES - 1)) + nbytes > PAGE_BYTES ||
+		    page_unpack (len, 0) != nbytes) {
+			/* corrupted message */
+			goto failed;
+		}
+		page_begin ();
+		page_unpack (len, 1);
+		page_commit ();
+		address.dword += nbytes;
+		goto ok;
+#endif
+#ifdef PATTERN_FILL
+	} else if (msg_buf[0] == CMD_FILL_FLASH_ISP) {
+		/* Nonstandard command: fill memory range with a pattern.
+		 * msg_buf[1..4] NumBytes, high byte first
+		 * msg_buf[5..6] Pattern word, low byte first */
+		unsigned long count;
+		unsigned short i, n, word;
+
+		if (len < 7) {
+			/* corrupted message */
+			goto failed;
+		}
+		count = msg_buf[1];
+		count = count << 8 | msg_buf[2];
+		count = count << 8 | msg_buf[3];
+		count = count << 8 | msg_buf[4];
+		word = msg_buf[5] | msg_buf[6] << 8;
+#ifdef CRC_RANGE
+		if (! chip_erased)
+			goto failed;
+#endif
+		if ((count & 1) || (address.word.low & 1) ||
+		    address.dword > BADDR || count > BADDR - address.dword) {
+			/* only whole words below boot section */
+			goto failed;
+		}
+		if (address.dword == 0 && count > 0) {
+			/* Do not program address 0 right now,
+			 * just remember it. */
+			word0 = word;
+		}
+		while (count > 0) {
+			/* Up to the end of page */
+			n = PAGE_BYTES - (address.word.low & (PAGE_BYTES - 1));
+			if (n > count)
+				n = count;
+			page_begin ();
+			for (i=0; i<n; i+=2) {
+				page_fill (address.word.low + i,
+					(address.dword + i == 0) ? 0xFFFF : word);
+			}
+			page_commit ();
+			address.dword += n;
+			count -= n;
+		}
+		goto ok;
+#endif
+#ifdef CRC_RANGE
+	} else if (msg_buf[0] == CMD_CRC_FLASH_ISP) {
+		/* Nonstandard command: get checksum of memory range.
+		 * msg_buf[1..4] NumBytes, high byte first.
+		 * Without chip erase, only whole pages: the checksum
+		 * of a short range would reveal its contents. */
+		unsigned long count;
+		unsigned short sum;
+
+		if (len < 5) {
+			/* corrupted message */
+			goto failed;
+		}
+		count = msg_buf[1];
+		count = count << 8 | msg_buf[2];
+		count = count << 8 | msg_buf[3];
+		count = count << 8 | msg_buf[4];
+		if (! chip_erased && ((address.word.low | count) &
+		    (PAGE_BYTES - 1)) != 0)
+			goto failed;
+		if (address.dword >= BADDR)
+			count = 0;
+		else if (count > BADDR - address.dword)
+			count = BADDR - address.dword;
+#ifdef POSTED_WRITE
+		flash_sync ();
+#endif
+		sum = 0;
+		while (count-- > 0) {
+			sum = crc16 (sum, read_byte ());
+			++address.dword;
+#ifdef PROFILE
+			/* Keep the timer from wrapping */
+			if (address.byte[0] == 0)
+				prof_switch (PROF_CMD);
+#endif
+		}
+		msg_buf[1] = STATUS_CMD_OK;
+		msg_buf[2] = sum >> 8;
+		msg_buf[3] = sum;
+		return 4;
+#endif
 	}
 	/* we should not come here */
 	msg_buf[1] = STATUS_CMD_UNKNOWN;
@@ -591,28 +1503,161 @@ failed:		msg_buf[1] = STATUS_CMD_FAILED;
  */
 unsigned char read_byte ()
 {
-	/* Can handle odd and even nbytes okay */
-	if (address.word.high == 0) {
+	/* Can handle odd and even nbytes okay.
+	 * Word 0 is pending only when it's not all ones. */
+	if (address.word.high == 0 && word0 != 0xFFFF) {
 		if (address.word.low == 0)
 			return (unsigned char) word0;
 
 		if (address.word.low == 1)
 			return (unsigned char) (word0 >> 8);
 	}
-#if defined __AVR_ATmega128__
-	return elpm (address.word.low);
-#else
-	return lpm (address.word.low);
+#ifdef LAZY_ERASE
+	/* Page is not erased yet, but it is empty for the host. */
+	if (erase_pending (address.dword))
+		return 0xFF;
 #endif
+#ifdef RAMPZ
+	RAMPZ = address.byte[2];
+#endif
+	return flash_read (address.word.low);
 }
 
-unsigned short crc16 (unsigned short sum, unsigned char nibble)
+/*
+ * Update CRC-16 (x16 + x15 + x2 + 1, reflected) with one byte.
+ * Table-free form: the table entry for byte x is
+ * (x << 6) ^ (x << 7), plus 0xC001 when x has odd parity.
+ */
+unsigned short crc16 (unsigned short sum, unsigned char byte)
 {
-	/* compute checksum of lower four bits of byte */
-	return ((sum >> 4) & 0x0FFF) ^
-		poly_tab [sum & 0xF] ^
-		poly_tab [nibble & 0xF];
+	unsigned char x, parity;
+
+	x = sum ^ byte;
+	parity = x ^ (x >> 4);
+	parity ^= parity >> 2;
+	parity ^= parity >> 1;
+	sum = (sum >> 8) ^ ((unsigned short) x << 6) ^
+		((unsigned short) x << 7);
+	if (parity & 1)
+		sum ^= 0xC001;
+	return sum;
+}
+
+#ifdef BLANK_CHECK
+/*
+ * Check that the page is empty (all ones).
+ */
+unsigned char page_blank (unsigned long addr)
+{
+	unsigned short i;
+
+	/* Called for every page on erase, keep the timer from wrapping */
+	prof_switch (PROF_CMD);
+#ifdef RAMPZ
+	RAMPZ = addr >> 16;
+#endif
+	for (i=0; i<PAGE_BYTES; ++i) {
+		if (flash_read ((short) addr + i) != 0xFF)
+			return 0;
+	}
+	return 1;
 }
+#endif
+
+#ifdef PACKED
+/*
+ * Unpack run-length encoded data from msg_buf [10..len-1].
+ * Control byte n < 128 is followed by n+1 literal bytes.
+ * Control byte n >= 128 is followed by one byte,
+ * repeated n-126 times (2...129).
+ * When fill is set, store the data into the page buffer.
+ * Return the unpacked size, or 0xFFFF on format error.
+ */
+unsigned short page_unpack (unsigned short len, unsigned char fill)
+{
+	unsigned char *p, *end, n, c, lo, run;
+	unsigned short i, word;
+
+	p = msg_buf + 10;
+	end = msg_buf + len;
+	i = 0;
+	c = lo = 0;
+	while (p < end) {
+		n = *p++;
+		run = (n >= 128);
+		if (run) {
+			if (p >= end)
+				return 0xFFFF;
+			c = *p++;
+			n -= 126;
+		} else {
+			++n;
+			if (end - p < n)
+				return 0xFFFF;
+		}
+		for (; n>0; --n) {
+			if (! run)
+				c = *p++;
+			if (fill) {
+				if (! (i & 1)) {
+					lo = c;
+				} else {
+					word = lo | c << 8;
+					if (address.dword == 0 && i == 1) {
+						/* Do not program address 0
+						 * right now, just remember it. */
+						word0 = word;
+						word = 0xFFFF;
+					}
+					page_fill (address.word.low + i - 1, word);
+				}
+			}
+			++i;
+		}
+	}
+	return i;
+}
+#endif
+
+#ifdef INCREMENTAL
+/*
+ * Compare the page, pointed to by address, with msg_buf [10..].
+ * With lazy erase, a page with the same contents is kept:
+ * it is not to be erased any more.
+ */
+unsigned char page_differs ()
+{
+	unsigned short i;
+
+#ifdef RAMPZ
+	RAMPZ = address.byte[2];
+#endif
+	for (i=0; i<PAGE_BYTES; ++i) {
+		if (flash_read (address.word.low + i) != msg_buf [10 + i])
+			return 1;
+	}
+#ifdef LAZY_ERASE
+	i = address.dword / PAGE_BYTES;
+	erase_map [i >> 3] &= ~(1 << (i & 7));
+#endif
+	return 0;
+}
+#endif
+
+#ifdef LAZY_ERASE
+/*
+ * Check whether the page is still to be erased after chip erase.
+ */
+unsigned char erase_pending (unsigned long addr)
+{
+	unsigned short n;
+
+	if (addr >= BADDR)
+		return 0;
+	n = addr / PAGE_BYTES;
+	return erase_map [n >> 3] & (1 << (n & 7));
+}
+#endif
 
 #ifndef SPMCR
 #define SPMCR SPMCSR
@@ -623,72 +1668,611 @@ unsigned short crc16 (unsigned short sum, unsigned char nibble)
  */
 void page_erase (unsigned long addr)
 {
+#ifdef LAZY_ERASE
+	unsigned short n;
+
+	if (addr < BADDR) {
+		n = addr / PAGE_BYTES;
+		erase_map [n >> 3] &= ~(1 << (n & 7));
+	}
+#endif
 	/* Wait for previous spm to complete */
-	while (SPMCR & (1 << SPMEN))
-		continue;
+#ifdef POSTED_WRITE
+	flash_sync ();
+#else
+	spm_wait ();
+#endif
 
-#if defined __AVR_ATmega128__
-	if ((short) (addr >> 16) != 0)
-		RAMPZ = 1;
-	else
-		RAMPZ = 0;
+#ifdef RAMPZ
+	RAMPZ = addr >> 16;
 #endif
 	/* Erase page */
-	SPMCR = (1 << PGERS) | (1 << SPMEN);
-	spm (addr);
-	while (SPMCR & (1 << SPMEN))
-		continue;
+	spm_cmd ((1 << PGERS) | (1 << SPMEN), addr);
+	spm_wait ();
 
 	/* Re-enable RWW section */
-	SPMCR = (1 << RWWSRE) | (1 << SPMEN);
-	spm (addr);
-	while (SPMCR & (1 << SPMEN))
-		continue;
+	spm_cmd ((1 << RWWSRE) | (1 << SPMEN), addr);
+	spm_wait ();
 }
 
 /*
- * Program page, pointed to by address.
+ * Program memory, starting from address. Data may span
+ * several pages. Address is advanced past the data.
  * Use data from msg_buf [10..nbytes+10].
+ * With VERIFY, every page is read back after the write;
+ * return 1 on mismatch.
  */
-void page_write ()
+unsigned char page_write ()
 {
-	unsigned short i, addr;
+	unsigned char *data, status;
+	unsigned short i, n;
+#ifdef VERIFY
+	unsigned short k;
+#endif
+
+	data = msg_buf + 10;
+	n = nbytes;
+	status = 0;
+	while (n > 0) {
+#ifdef STREAM_FILL
+		if (filled != 0) {
+			/* Start of the page is already loaded */
+			i = filled;
+			filled = 0;
+		} else
+#endif
+		{
+			page_begin ();
+			page_fill (address.word.low, *(short*) data);
+			i = 2;
+		}
+		while (i < n && ((address.word.low + i) &
+		    (PAGE_BYTES - 1)) != 0) {
+			page_fill (address.word.low + i, *(short*) (data + i));
+			i += 2;
+		}
+		page_commit ();
+#ifdef VERIFY
+#ifdef POSTED_WRITE
+		flash_sync ();
+#endif
+		/* RAMPZ is set by page_begin() */
+		for (k=0; k<i && k<n; ++k) {
+			if (flash_read (address.word.low + k) != data[k])
+				status = 1;
+		}
+#endif
+		address.dword += i;
+		if (i > n) {
+			/* odd length */
+			break;
+		}
+		data += i;
+		n -= i;
+	}
+	return status;
+}
 
+/*
+ * Prepare for filling the page buffer.
+ */
+void page_begin ()
+{
 	/* Wait for previous spm to complete */
-	while (SPMCR & (1 << SPMEN))
-		continue;
+#ifdef POSTED_WRITE
+	flash_sync ();
+#else
+	spm_wait ();
+#endif
+#ifdef LAZY_ERASE
+	/* First write to the page after chip erase.
+	 * Must be erased before filling the page buffer. */
+	if (erase_pending (address.dword))
+		page_erase (address.dword);
+#endif
 
-#if defined __AVR_ATmega128__
-	if (address.word.high != 0)
-		RAMPZ = 1;
-	else
-		RAMPZ = 0;
-#endif
-	addr = address.word.low;
-	for (i=0; i<nbytes; i+=2, addr+=2) {
-		/* Write word, zero register is clobbered */
-		load_r0r1 (*(short*) (msg_buf + 10 + i));
-		SPMCR = (1 << SPMEN);
-		spm (addr);
-		while (SPMCR & (1 << SPMEN))
+#ifdef RAMPZ
+	RAMPZ = address.byte[2];
+#endif
+}
+
+/*
+ * Store a word into the page buffer.
+ */
+void page_fill (unsigned short addr, unsigned short word)
+{
+	/* Write word, zero register is clobbered */
+	load_r0r1 (word);
+	spm_cmd (1 << SPMEN, addr);
+	spm_wait ();
+
+	/* Clear zero register */
+	clear_zero_reg ();
+}
+
+/*
+ * Write the page buffer to the page, pointed to by address.
+ */
+void page_commit ()
+{
+	/* Write page */
+	spm_cmd ((1 << PGWRT) | (1 << SPMEN), address.word.low);
+#ifdef POSTED_WRITE
+	/* Do not wait: the answer is sent and the next frame
+	 * is received while the page is being written.
+	 * RWW section is re-enabled later by flash_sync(). */
+	rww_busy = 1;
+#else
+	spm_wait ();
+
+	/* Re-enable RWW section */
+	spm_cmd ((1 << RWWSRE) | (1 << SPMEN), address.word.low);
+	spm_wait ();
+#endif
+}
+
+#ifdef POSTED_WRITE
+/*
+ * Wait for posted page write to complete and re-enable RWW section.
+ * Must be called before reading flash memory.
+ */
+void flash_sync ()
+{
+	spm_wait ();
+	if (rww_busy) {
+		spm_cmd ((1 << RWWSRE) | (1 << SPMEN), 0);
+		spm_wait ();
+		rww_busy = 0;
+	}
+}
+#endif
+
+#ifdef EEPROM
+/*
+ * Queue a byte to be written to EEPROM.
+ * When the queue is full, wait for a free slot.
+ */
+void ee_queue (unsigned short addr, unsigned char data)
+{
+	unsigned char next;
+
+	next = (ee_head + 1) & (EE_QSIZE - 1);
+	if (next == ee_tail) {
+		prof_enter (PROF_SPM);
+		while (next == ee_tail) {
+			prof_switch (PROF_SPM);
+			ee_poll ();
+		}
+		prof_leave ();
+	}
+	ee_qaddr [ee_head] = addr;
+	ee_qdata [ee_head] = data;
+	ee_head = next;
+}
+
+/*
+ * Start next EEPROM write, if the previous one is complete.
+ * Queued bytes go first, interleaved with erasing after chip erase.
+ * A queued byte is written at once; when not erased yet, it is
+ * marked in ee_done, and the erase skips it.
+ * Bytes which already have the needed value are skipped.
+ */
+void ee_poll ()
+{
+	unsigned short addr;
+	unsigned char data;
+
+	if (ee_busy () || (SPMCR & (1 << SPMEN)))
+		return;
+	if (ee_tail != ee_head) {
+		addr = ee_qaddr [ee_tail];
+		data = ee_qdata [ee_tail];
+		ee_tail = (ee_tail + 1) & (EE_QSIZE - 1);
+		if (addr >= ee_wipe)
+			ee_done [addr >> 3] |= 1 << (addr & 7);
+		goto write;
+	}
+	for (;;) {
+		if (ee_wipe > E2END)
+			return;
+		addr = ee_wipe++;
+		if (ee_done [addr >> 3] & (1 << (addr & 7)))
 			continue;
+#ifdef RS485
+		if (addr == NODE_EEADDR) {
+			/* Keep the node address */
+			continue;
+		}
+#endif
+		break;
+	}
+	data = 0xFF;
+write:
+	if (ee_read (addr) != data)
+		ee_start (addr, data);
+}
 
-		/* Clear zero register */
-		asm volatile ("clr __zero_reg__");
+/*
+ * Complete queued EEPROM writes.
+ * With all set, complete the erase after chip erase as well.
+ */
+void ee_sync (unsigned char all)
+{
+	prof_enter (PROF_SPM);
+	while (ee_tail != ee_head || (all && ee_wipe <= E2END)) {
+		prof_switch (PROF_SPM);
+		ee_poll ();
 	}
-	/* Write page */
-	SPMCR = (1 << PGWRT) | (1 << SPMEN);
-	spm (address.word.low);
-	while (SPMCR & (1 << SPMEN))
+	while (ee_busy ())
+		prof_switch (PROF_SPM);
+	prof_leave ();
+}
+
+/*
+ * Start erasing EEPROM in background, on chip erase.
+ * Queued writes are dropped: the erase would clear them anyway.
+ */
+void ee_erase ()
+{
+	unsigned short i;
+
+	ee_tail = ee_head;
+	for (i=0; i<sizeof (ee_done); ++i)
+		ee_done[i] = 0;
+	ee_wipe = 0;
+}
+
+/*
+ * Read a byte of EEPROM, as it will be when pending writes are done:
+ * the last queued value, or 0xFF when the byte is still to be erased.
+ * Only the write in progress is waited for.
+ */
+unsigned char ee_get (unsigned short addr)
+{
+	unsigned char i, found = 0, data = 0xFF;
+
+	for (i=ee_tail; i!=ee_head; i=(i+1)&(EE_QSIZE-1)) {
+		if (ee_qaddr[i] == addr) {
+			data = ee_qdata[i];
+			found = 1;
+		}
+	}
+	if (found)
+		return data;
+	if (addr >= ee_wipe && ! (ee_done [addr >> 3] & (1 << (addr & 7)))
+#ifdef RS485
+	    && addr != NODE_EEADDR
+#endif
+	    ) {
+		/* Not erased yet */
+		return 0xFF;
+	}
+	while (ee_busy ())
 		continue;
+	return ee_read (addr);
+}
+#endif /* EEPROM */
 
-	/* Re-enable RWW section */
-	SPMCR = (1 << RWWSRE) | (1 << SPMEN);
-	spm (address.word.low);
+#if defined EEPROM || defined RS485
+#ifdef __AVR__
+unsigned char ee_read (unsigned short addr)
+{
+	EEAR = addr;
+	EECR |= 1 << EERE;
+	return EEDR;
+}
+
+/*
+ * Start writing a byte, do not wait for completion.
+ * EEWE must be set within four cycles after EEMWE.
+ */
+void ee_start (unsigned short addr, unsigned char data)
+{
+	EEAR = addr;
+	EEDR = data;
+#ifdef EEPM0
+	/* Erase only, in half the time of erase and write */
+	EECR = (data == 0xFF) ? 1 << EEPM0 : 0;
+#endif
+#ifdef RX_INTERRUPT
+	cli ();
+#endif
+	EECR |= 1 << EEMWE;
+	EECR |= 1 << EEWE;
+#ifdef RX_INTERRUPT
+	sei ();
+#endif
+}
+#endif /* __AVR__ */
+#endif
+
+#ifdef RS485
+/*
+ * Process a broadcast frame, with no answer. Only commands
+ * for programming flash are accepted. The first failure is kept
+ * in node_status and the frames are counted, both are reset
+ * by chip erase: the host polls every node for them later.
+ */
+void node_broadcast (unsigned char seqnum, unsigned short msglen)
+{
+	unsigned char cmd;
+
+	cmd = msg_buf[0];
+	if (cmd != CMD_LOAD_ADDRESS && cmd != CMD_CHIP_ERASE_ISP &&
+	    cmd != CMD_PROGRAM_FLASH_ISP && cmd != CMD_ENTER_PROGMODE_ISP &&
+	    cmd != CMD_LEAVE_PROGMODE_ISP)
+		return;
+	if (cmd == CMD_CHIP_ERASE_ISP) {
+		node_status = 0;
+		node_frames = 0;
+	}
+	prof_switch (PROF_CMD);
+	program_cmd (seqnum, msglen);
+	prof_switch (PROF_PARSE);
+	if (msg_buf[1] != STATUS_CMD_OK && node_status == 0)
+		node_status = msg_buf[1];
+	node_frames++;
+#ifdef LEAVE_START
+	if (app_go) {
+#ifdef EEPROM
+		ee_sync (1);
+#endif
+		app_start ();
+	}
+#endif
+}
+#endif
+
+#ifdef STREAM_FILL
+/*
+ * A word of CMD_PROGRAM_FLASH_ISP data at given offset is received:
+ * load it into the page buffer right away, so only page write
+ * is left after the checksum. Words of the first page only.
+ * Without receive interrupt, we cannot wait for flash here,
+ * so the page is started only when no erase or write is needed,
+ * and no EEPROM write is in progress or pending.
+ */
+void stream_fill (unsigned short offset, unsigned short msglen)
+{
+	if (msg_buf[0] != CMD_PROGRAM_FLASH_ISP)
+		return;
+#ifdef RS485
+	if (node_dest != node_addr && node_dest != NODE_BROADCAST)
+		return;
+#endif
+	if (offset == 0) {
+		/* Address 0 is deferred, see word0 */
+		if (address.dword == 0)
+			return;
+#ifndef RX_INTERRUPT
+		if ((SPMCR & (1 << SPMEN)) || ee_busy ())
+			return;
+#ifdef EEPROM
+		/* Writes would be started between received bytes */
+		if (ee_wipe <= E2END || ee_tail != ee_head)
+			return;
+#endif
+#ifdef LAZY_ERASE
+		if (erase_pending (address.dword))
+			return;
+#endif
+#endif
+		page_begin ();
+	} else if (filled != offset) {
+		/* Not started */
+		return;
+	}
+	if (offset + 12 > msglen ||
+	    offset + 2 > ((unsigned short) msg_buf[1] << 8 | msg_buf[2]) ||
+	    offset >= PAGE_BYTES - (address.word.low & (PAGE_BYTES - 1)))
+		return;
+	page_fill (address.word.low + offset, *(short*) (msg_buf + 10 + offset));
+	filled = offset + 2;
+}
+
+/*
+ * The frame was rejected: clear the page buffer.
+ */
+void stream_cancel ()
+{
+	spm_cmd ((1 << RWWSRE) | (1 << SPMEN), 0);
+	spm_wait ();
+	filled = 0;
+}
+#endif
+
+#ifdef STAGING
+/*
+ * Staging area for the image, stored by the application:
+ * from STAGE_ADDR up to the info page, just below the boot section.
+ * The info page starts with three words: STAGE_MAGIC, number
+ * of pages, and CRC-16 of the staged pages.
+ */
+#ifndef STAGE_ADDR
+#define STAGE_ADDR	((BADDR - PAGE_BYTES) / 2 & ~(PAGE_BYTES - 1UL))
+#endif
+#define STAGE_INFO	(BADDR - PAGE_BYTES)
+#define STAGE_PAGES	((STAGE_ADDR < STAGE_INFO - STAGE_ADDR ? \
+			  STAGE_ADDR : STAGE_INFO - STAGE_ADDR) / PAGE_BYTES)
+#define STAGE_MAGIC	0x5354
+
+/*
+ * Write a page of staging area from RAM, for the application.
+ * Return 0 on success.
+ */
+unsigned char stage_write (unsigned long addr, const unsigned char *data)
+{
+	unsigned short i;
+
+	if ((addr & (PAGE_BYTES - 1)) || addr < STAGE_ADDR ||
+	    addr > STAGE_INFO) {
+		/* only pages of staging area */
+		return 1;
+	}
+	flash_erase (addr);
+	for (i=0; i<PAGE_BYTES; i+=2)
+		flash_fill (addr + i, *(short*) (data + i));
+	return flash_write (addr);
+}
+
+/*
+ * Read a byte of flash at any address.
+ * Global variables are not initialized yet.
+ */
+unsigned char stage_byte (unsigned long addr)
+{
+#ifdef RAMPZ
+	RAMPZ = addr >> 16;
+#endif
+	return flash_read ((unsigned short) addr);
+}
+
+/*
+ * Check that the info page is valid, and the staged image
+ * matches its checksum.
+ */
+unsigned char stage_valid ()
+{
+	unsigned long addr, end;
+	unsigned short sum;
+
+	if (stage_byte (STAGE_INFO) != (unsigned char) STAGE_MAGIC ||
+	    stage_byte (STAGE_INFO + 1) != STAGE_MAGIC >> 8)
+		return 0;
+	end = stage_byte (STAGE_INFO + 2) |
+		(unsigned short) stage_byte (STAGE_INFO + 3) << 8;
+	if (end == 0 || end > STAGE_PAGES)
+		return 0;
+	end = STAGE_ADDR + end * PAGE_BYTES;
+	sum = 0;
+	for (addr=STAGE_ADDR; addr<end; ++addr) {
+		sum = crc16 (sum, stage_byte (addr));
+		watchdog_reset ();
+	}
+	return (stage_byte (STAGE_INFO + 4) == (unsigned char) sum &&
+		stage_byte (STAGE_INFO + 5) == sum >> 8);
+}
+
+/*
+ * Copy the staged image to the application area page by page,
+ * then erase the info page. When interrupted by reset, the copy
+ * is started again on next boot.
+ */
+void stage_commit ()
+{
+	unsigned short n, i;
+
+	n = stage_byte (STAGE_INFO + 2) |
+		(unsigned short) stage_byte (STAGE_INFO + 3) << 8;
+	nbytes = PAGE_BYTES;
+	for (address.dword=0; n>0; --n) {
+		for (i=0; i<PAGE_BYTES; ++i) {
+			msg_buf [10 + i] = stage_byte (STAGE_ADDR +
+				address.dword + i);
+		}
+		page_erase (address.dword);
+
+		/* Address is advanced to the next page */
+		page_write ();
+	}
+	page_erase (STAGE_INFO);
+}
+#endif
+
+#ifdef FLASH_API
+/*
+ * Run SPM operation for the application, and wait for it.
+ * Called through the table at BADDR+12, so no global variables
+ * of boot loader are used: memory belongs to the application.
+ * Interrupts are disabled, as vectors are in the application
+ * section. RWW section is re-enabled before return after erase
+ * or write: the application cannot run while it is busy.
+ */
+void api_spm (unsigned char cmd, unsigned long addr, unsigned short word)
+{
+	unsigned char sreg;
+#ifdef RAMPZ
+	unsigned char rampz;
+#endif
+
+	sreg = SREG;
+	cli ();
+	while (ee_busy ())
+		continue;
+#ifdef RAMPZ
+	rampz = RAMPZ;
+	RAMPZ = addr >> 16;
+#endif
+	/* Write word, zero register is clobbered */
+	load_r0r1 (word);
+	SPMCR = cmd;
+	spm (addr);
+	clear_zero_reg ();
 	while (SPMCR & (1 << SPMEN))
 		continue;
+	if (cmd & ((1 << PGERS) | (1 << PGWRT))) {
+		SPMCR = (1 << RWWSRE) | (1 << SPMEN);
+		spm (addr);
+		while (SPMCR & (1 << SPMEN))
+			continue;
+	}
+#ifdef RAMPZ
+	RAMPZ = rampz;
+#endif
+	SREG = sreg;
+}
+
+/*
+ * Erase the page at byte address.
+ * Boot section is protected: return 1.
+ */
+unsigned char flash_erase (unsigned long addr)
+{
+	if (addr >= BADDR)
+		return 1;
+	api_spm ((1 << PGERS) | (1 << SPMEN), addr, 0);
+	return 0;
 }
 
+/*
+ * Store a word into the page buffer, at given byte offset.
+ */
+void flash_fill (unsigned short addr, unsigned short word)
+{
+	api_spm (1 << SPMEN, addr, word);
+}
+
+/*
+ * Write the page buffer to the page at byte address.
+ * Boot section is protected: return 1.
+ */
+unsigned char flash_write (unsigned long addr)
+{
+	if (addr >= BADDR)
+		return 1;
+	api_spm ((1 << PGWRT) | (1 << SPMEN), addr, 0);
+	return 0;
+}
+
+/*
+ * Re-enable RWW section, also clears the page buffer.
+ */
+void flash_rww ()
+{
+	api_spm ((1 << RWWSRE) | (1 << SPMEN), 0, 0);
+}
+
+#ifndef STAGING
+/*
+ * No staging area: keep the table entry, refuse any page.
+ */
+unsigned char stage_write (unsigned long addr, const unsigned char *data)
+{
+	return 1;
+}
+#endif
+#endif
+
 #ifndef UBRRL
 #define UBRRL UBRR0L
 #endif
@@ -705,6 +2289,113 @@ void page_write ()
 #define	UCSRC UCSR0C
 #endif
 
+#ifdef RX_INTERRUPT
+#ifdef __AVR__
+#define uart_ready()	(rx_head != rx_tail)
+#else
+/* The mock delivers interrupts as time goes */
+#define uart_ready()	host_rx_ready (rx_head != rx_tail)
+#endif
+#else
+#define uart_ready()	(UCSRA & (1 << RXC))
+#endif
+
+#ifdef BAUD_SWITCH
+/*
+ * Clock divided by 8 * 4800, the divisor at double speed
+ * for baud rate 4800. Timeout at new baud rate is a second
+ * of Timer1: at clock/8 when it runs for profiling,
+ * otherwise at clock/1024.
+ */
+#define BAUD_Q		((KHZ * 1000L + 19200) / 38400)
+#ifdef PROFILE
+#define BAUD_TIMEOUT	(KHZ * 1000L / 8)
+#else
+#define BAUD_TIMEOUT	(KHZ * 1000L / 1024)
+#endif
+#endif
+
+#ifdef ENTRY_WINDOW
+/*
+ * Length of entry window in Timer1 ticks at clock/1024,
+ * and the sync bytes to stay in boot loader.
+ */
+#define ENTRY_TICKS	(KHZ * 1L * ENTRY_WINDOW / 1024)
+#if ENTRY_TICKS > 65535
+#error ENTRY_WINDOW is too long!
+#endif
+#ifndef ENTRY_SYNC1
+#define ENTRY_SYNC1	'S'
+#endif
+#ifndef ENTRY_SYNC2
+#define ENTRY_SYNC2	'B'
+#endif
+
+/*
+ * Cold boot with application present: wait ENTRY_WINDOW msec
+ * for the sync bytes from the host. Return 1 when received.
+ * Interrupts are disabled, so UART is polled directly.
+ */
+unsigned char entry_sync ()
+{
+	unsigned char c, prev;
+
+	uart_init ();
+	TCNT1 = 0;
+	TCCR1B = (1 << CS12) | (1 << CS10);
+	prev = 0;
+	c = 0;
+	while (TCNT1 < ENTRY_TICKS) {
+		watchdog_reset ();
+		if (! (UCSRA & (1 << RXC)))
+			continue;
+		prev = c;
+		c = UDR;
+		if (prev == ENTRY_SYNC1 && c == ENTRY_SYNC2)
+			break;
+	}
+	/* Stop the timer */
+	TCCR1B = 0;
+	TCNT1 = 0;
+	return (prev == ENTRY_SYNC1 && c == ENTRY_SYNC2);
+}
+#endif
+
+#ifdef __AVR__
+/*
+ * Start the application from address 0.
+ */
+void app_start ()
+{
+#ifdef RX_INTERRUPT
+	/* Move interrupt vectors back to the application */
+	cli ();
+	IVREG = 1 << IVCE;
+	IVREG = 0;
+#endif
+#if defined ENTRY_WINDOW || defined LEAVE_START || defined STAGING
+	/* Leave UART in reset state */
+	UCSRB = 0;
+	UCSRA = 0;
+	UBRRH = 0;
+	UBRRL = 0;
+#endif
+#ifdef RS485
+	DE_DDR &= ~(1 << DE_BIT);
+#endif
+#if defined PROFILE || defined BAUD_SWITCH
+	/* Stop the timer */
+	TCCR1B = 0;
+	TCNT1 = 0;
+#endif
+#ifdef EIND
+	/* Indirect jump uses EIND on chips above 128 kbytes */
+	EIND = 0;
+#endif
+	((void (*) ()) 0) ();
+}
+#endif /* __AVR__ */
+
 void uart_init (void)
 {
 	unsigned short divisor;
@@ -717,8 +2408,13 @@ void uart_init (void)
 	/* format: asynchronous, 8data, no parity, 1stop bit */
 	UCSRC = (3 << UCSZ0);
 
+#ifdef RX_INTERRUPT
+	/* enable tx/rx and interrupt on rx */
+	UCSRB = (1 << RXEN) | (1 << TXEN) | (1 << RXCIE);
+#else
 	/* enable tx/rx and no interrupt on tx/rx */
 	UCSRB = (1 << RXEN) | (1 << TXEN);
+#endif
 }
 
 /*
@@ -727,8 +2423,18 @@ void uart_init (void)
 void uart_putchar (char c)
 {
 	/* wait for empty transmit buffer */
-	while (! (UCSRA & (1 << UDRE)))
-		continue;
+	prof_enter (PROF_TX);
+	while (! (UCSRA & (1 << UDRE))) {
+		prof_switch (PROF_TX);
+	}
+	prof_leave ();
+#if defined BAUD_SWITCH || defined LEAVE_START || defined RS485
+	/* clear transmit complete flag */
+	UCSRA |= 1 << TXC;
+#endif
+#ifdef RS485
+	DE_PORT |= 1 << DE_BIT;
+#endif
 	UDR = c;
 }
 
@@ -738,7 +2444,154 @@ void uart_putchar (char c)
  */
 unsigned char uart_getchar (void)
 {
-	while (! (UCSRA & (1 << RXC)))
-		continue;
+#ifdef RX_INTERRUPT
+	unsigned char c;
+#endif
+#ifdef BAUD_SWITCH
+	unsigned short now;
+#endif
+
+	prof_switch (PROF_RX);
+	while (! uart_ready ()) {
+		prof_switch (PROF_RX);
+#ifdef EEPROM
+		ee_poll ();
+#endif
+#ifdef BAUD_SWITCH
+		if (baud_trial) {
+			now = TCNT1;
+			baud_ticks += (unsigned short) (now - baud_stamp);
+			baud_stamp = now;
+			if (baud_ticks >= BAUD_TIMEOUT) {
+				/* No frames at new baud rate: fall back */
+				baud_trial = 0;
+				uart_init ();
+				param_baudrate = BAUDRATE / 4800;
+			}
+		}
+#endif
+	}
+	prof_switch (PROF_PARSE);
+#ifdef RX_INTERRUPT
+	c = rx_buf [rx_tail];
+	rx_tail = (rx_tail + 1) & (RX_BUFSZ - 1);
+	return c;
+#else
 	return (UDR);
+#endif
+}
+
+#if defined BAUD_SWITCH || defined LEAVE_START || defined RS485
+/*
+ * Wait until the last byte is shifted out.
+ */
+void uart_flush ()
+{
+	while (! (UCSRA & (1 << TXC)))
+		continue;
 }
+#endif
+
+#ifdef BAUD_SWITCH
+/*
+ * Set new baud rate, selected by baud_select().
+ */
+void uart_switch ()
+{
+	uart_flush ();
+	UBRRL = (unsigned char) baud_ubrr;
+	UBRRH = baud_ubrr >> 8;
+	UCSRA = (baud_change == 2) ? 1 << U2X : 0;
+	baud_change = 0;
+#ifndef PROFILE
+	TCCR1B = (1 << CS12) | (1 << CS10);
+#endif
+	baud_stamp = TCNT1;
+	baud_ticks = 0;
+	baud_trial = 1;
+}
+
+/*
+ * Select divisor for baud rate code*4800, normal or double speed.
+ * Double speed gives all the rates of normal mode and more,
+ * so normal mode is used only when the divisor is even.
+ * Return 0 when the rate error is more than 2%.
+ */
+unsigned char baud_select (unsigned char code)
+{
+	unsigned short n, err;
+
+	if (code == 0)
+		return 0;
+	n = (BAUD_Q + code / 2) / code;
+	if (n == 0)
+		return 0;
+	err = (n * code > BAUD_Q) ? n * code - BAUD_Q : BAUD_Q - n * code;
+	if (err * 50 > BAUD_Q)
+		return 0;
+	if (n & 1) {
+		baud_change = 2;
+		baud_ubrr = n - 1;
+	} else {
+		baud_change = 1;
+		baud_ubrr = n / 2 - 1;
+	}
+	param_baudrate = code;
+	return 1;
+}
+#endif
+
+#ifdef RX_INTERRUPT
+/*
+ * Receive interrupt: put a byte into the ring buffer.
+ * The handler is placed in the boot section, so it runs
+ * while the application section is busy with erase or write.
+ * On overflow the byte is lost, and the host gets
+ * a checksum error.
+ */
+#ifdef __AVR__
+void __vector_uart_rx (void) __attribute__ ((signal, used));
+#endif
+
+void __vector_uart_rx ()
+{
+	unsigned char c, next;
+
+	c = UDR;
+	next = (rx_head + 1) & (RX_BUFSZ - 1);
+	if (next != rx_tail) {
+		rx_buf [rx_head] = c;
+		rx_head = next;
+	}
+}
+#endif
+
+#ifdef PROFILE
+/*
+ * Account the time since the last call to the current state,
+ * and switch to a new state. Must be called more often
+ * than every 65536 ticks of the timer.
+ */
+void prof_switch (unsigned char state)
+{
+	unsigned short now;
+
+	now = TCNT1;
+	prof_count [prof_state] += (unsigned short) (now - prof_stamp);
+	prof_stamp = now;
+	prof_state = state;
+}
+
+/*
+ * Start the timer and clear counters.
+ */
+void prof_clear ()
+{
+	unsigned char i;
+
+	TCCR1B = 1 << CS11;
+	for (i=0; i<PROF_NSTATES; ++i)
+		prof_count[i] = 0;
+	prof_stamp = TCNT1;
+}
+#endif
@@ -0,0 +1,255 @@
+/*
+ * Test of stkfleet against boards, emulated on pseudo-terminals.
+ * Every board is a process with the host build of StkBoot boot loader
+ * (flash memory and SPM mocked by host/mock.c), serving the master
+ * side of a pseudo-terminal. A random image is programmed into all
+ * boards by stkfleet through slave sides, then flash contents
+ * of every board are compared with the image.
+ *
+ * Usage:
+ *	ptyboard [-n boards] [-s kbytes] [-l write] stkfleet [option...]
+ * Options:
+ *	-n boards	number of boards, default 50
+ *	-s kbytes	size of image, default 64
+ *	-l write	lose the given page write of every board,
+ *			to check that stkfleet programs the page again
+ *
+ * Built by `make host-fleet` in the top directory.
+ *
+ * This program is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU General
+ * Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/wait.h>
+#include "mock.h"
+
+#ifdef RS485
+#error stkfleet does not support RS485 frames
+#endif
+
+#define MAXBOARDS	256
+#define TIMEOUT_SEC	5		/* boards to finish after stkfleet */
+
+int master [MAXBOARDS];
+char *slave [MAXBOARDS];
+pid_t pid [MAXBOARDS];
+unsigned char *image;
+unsigned long image_size;
+
+/*
+ * Random image, with some empty pages for stkfleet to skip.
+ */
+void make_image (const char *filename)
+{
+	FILE *fd;
+	unsigned long i;
+
+	image = malloc (image_size);
+	if (! image) {
+		perror ("malloc");
+		exit (1);
+	}
+	srand (1);
+	for (i=0; i<image_size; ++i) {
+		if ((i / HOST_PAGE_BYTES) % 5 == 3)
+			image[i] = 0xFF;
+		else
+			image[i] = rand ();
+	}
+	fd = fopen (filename, "wb");
+	if (! fd || fwrite (image, 1, image_size, fd) != image_size ||
+	    fclose (fd) != 0) {
+		perror (filename);
+		exit (1);
+	}
+}
+
+/*
+ * Open a pseudo-terminal in raw mode: the slave side echoes
+ * nothing before stkfleet opens it.
+ */
+void open_pty (int n)
+{
+	struct termios t;
+	int fd;
+
+	master[n] = posix_openpt (O_RDWR | O_NOCTTY);
+	if (master[n] < 0 || grantpt (master[n]) < 0 ||
+	    unlockpt (master[n]) < 0) {
+		perror ("posix_openpt");
+		exit (1);
+	}
+	slave[n] = strdup (ptsname (master[n]));
+	fd = open (slave[n], O_RDWR | O_NOCTTY);
+	if (fd < 0 || tcgetattr (fd, &t) < 0) {
+		perror (slave[n]);
+		exit (1);
+	}
+	cfmakeraw (&t);
+	tcsetattr (fd, TCSANOW, &t);
+	close (fd);
+}
+
+/*
+ * Board process: serve the port, then check flash contents.
+ * Exit status 0 when flash matches the image.
+ */
+void board (int n, int nboards, unsigned long lost)
+{
+	unsigned char buf [256];
+	unsigned long i;
+	int k;
+
+	for (k=0; k<nboards; ++k)
+		if (k != n)
+			close (master[k]);
+	memset (host_flash, 0xFF, sizeof (host_flash));
+	memset (host_eeprom, 0xFF, sizeof (host_eeprom));
+	host_lost_write = lost;
+	host_serve (master[n]);
+
+	/* With LEAVE_START, the application is started:
+	 * keep the port open, until stkfleet closes it. */
+	while (read (master[n], buf, sizeof (buf)) > 0)
+		continue;
+
+	for (i=0; i<BADDR; ++i) {
+		if (host_flash[i] != (i < image_size ? image[i] : 0xFF)) {
+			fprintf (stderr, "%s: flash differs at 0x%lx\n",
+				slave[n], i);
+			exit (1);
+		}
+	}
+	exit (0);
+}
+
+void usage ()
+{
+	fprintf (stderr, "Usage:\n");
+	fprintf (stderr, "\tptyboard [-n boards] [-s kbytes] [-l write] stkfleet [option...]\n");
+	exit (1);
+}
+
+int main (int argc, char **argv)
+{
+	char filename [] = "/tmp/ptyboardXXXXXX.bin";
+	char **args;
+	int nboards = 50, ch, fd, k, status, nfailed, nargs;
+	unsigned long lost = 0;
+	pid_t fleet;
+	time_t deadline;
+
+	image_size = 64 * 1024;
+	while ((ch = getopt (argc, argv, "+n:s:l:")) != -1) {
+		switch (ch) {
+		case 'n':
+			nboards = atoi (optarg);
+			break;
+		case 's':
+			image_size = strtoul (optarg, 0, 0) * 1024;
+			break;
+		case 'l':
+			lost = strtoul (optarg, 0, 0);
+			break;
+		default:
+			usage ();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 1)
+		usage ();
+	if (nboards < 1 || nboards > MAXBOARDS) {
+		fprintf (stderr, "Bad number of boards: %d\n", nboards);
+		exit (1);
+	}
+	if (image_size == 0 || image_size > BADDR) {
+		fprintf (stderr, "Bad image size: %lu\n", image_size);
+		exit (1);
+	}
+	fd = mkstemps (filename, 4);
+	if (fd < 0) {
+		perror (filename);
+		exit (1);
+	}
+	close (fd);
+	make_image (filename);
+
+	for (k=0; k<nboards; ++k)
+		open_pty (k);
+	for (k=0; k<nboards; ++k) {
+		pid[k] = fork ();
+		if (pid[k] < 0) {
+			perror ("fork");
+			exit (1);
+		}
+		if (pid[k] == 0)
+			board (k, nboards, lost);
+	}
+	for (k=0; k<nboards; ++k)
+		close (master[k]);
+
+	/* Run stkfleet with given options, the image and all ports */
+	nargs = 0;
+	args = malloc ((argc + nboards + 2) * sizeof (char*));
+	for (k=0; k<argc; ++k)
+		args [nargs++] = argv[k];
+	args [nargs++] = filename;
+	for (k=0; k<nboards; ++k)
+		args [nargs++] = slave[k];
+	args [nargs] = 0;
+	fflush (stdout);
+	fleet = fork ();
+	if (fleet == 0) {
+		execv (args[0], args);
+		perror (args[0]);
+		_exit (127);
+	}
+	if (fleet < 0 || waitpid (fleet, &status, 0) < 0) {
+		perror ("stkfleet");
+		status = -1;
+	}
+	unlink (filename);
+
+	/* Boards finish when their ports are closed */
+	nfailed = 0;
+	deadline = time (0) + TIMEOUT_SEC;
+	for (k=0; k<nboards; ++k) {
+		int board_status;
+
+		while (waitpid (pid[k], &board_status, WNOHANG) == 0) {
+			if (time (0) > deadline) {
+				fprintf (stderr, "%s: port not used\n", slave[k]);
+				kill (pid[k], SIGKILL);
+				waitpid (pid[k], &board_status, 0);
+				break;
+			}
+			usleep (10000);
+		}
+		if (! WIFEXITED (board_status) || WEXITSTATUS (board_status) != 0)
+			nfailed++;
+	}
+	printf ("%d boards, %d with wrong flash contents\n", nboards, nfailed);
+	if (status != 0) {
+		printf ("stkfleet failed\n");
+		return 1;
+	}
+	return nfailed ? 1 : 0;
+}
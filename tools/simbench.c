@@ -0,0 +1,371 @@
+/*
+ * Cycle-accurate benchmark for StkBoot boot loader under simavr.
+ * Runs the boot loader image on a simulated chip, with a scripted
+ * STK500 host on the UART: programs flash, reads it back and sends
+ * a stream of frames with bad checksum. Cycles are accounted per
+ * function of the image, using the symbol table from avr-nm -S.
+ * Time spent inside uart_getchar() and uart_putchar() is counted
+ * as waiting for the line; everything else is busy time.
+ *
+ * Prints one line of a tab separated table:
+ *	mcu khz baud rx_cyc_byte page_cyc read_cyc_byte prog_kbs read_kbs
+ * Option -H prints the table header.
+ *
+ * Usage:
+ *	simbench [-H] -m mcu -f khz -b baud -a baddr [-n pages]
+ *		 [-p pagesize] -s symfile image.elf
+ *
+ * This program is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU General
+ * Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/avr_uart.h>
+
+#include "../stk500.h"
+
+#define MAXSYM		64
+#define MAXANSWER	300
+#define TIMEOUT_SEC	2		/* answer timeout, simulated */
+
+/*
+ * Function of the boot loader image.
+ */
+struct symbol {
+	char name [64];
+	unsigned long addr, size;
+	int kind;			/* one of FN_xxx */
+} sym [MAXSYM];
+int nsym;
+
+#define FN_OTHER	0
+#define FN_UART		1		/* waiting for the line */
+#define FN_PAGE		2		/* flash programming */
+
+/*
+ * Cycle counters of one phase.
+ */
+struct phase {
+	avr_cycle_count_t total, busy, page;
+	unsigned long bytes;		/* bytes sent to the device */
+};
+
+avr_t *avr;
+avr_irq_t *uart_in;
+int xon = 1;
+unsigned char answer [MAXANSWER];
+unsigned answer_len;
+int answer_done, signon_done;
+unsigned char seqnum;
+unsigned page_bytes = 256;
+unsigned long khz;
+
+void uart_out_hook (avr_irq_t *irq, uint32_t value, void *param)
+{
+	if (! signon_done) {
+		if (value == '\n')
+			signon_done = 1;
+		return;
+	}
+	if (answer_done || answer_len >= MAXANSWER)
+		return;
+	if (answer_len == 0 && value != MESSAGE_START)
+		return;
+	answer [answer_len++] = value;
+	if (answer_len >= 5 &&
+	    answer_len == 6 + (answer[2] << 8 | answer[3]))
+		answer_done = 1;
+}
+
+void xon_hook (avr_irq_t *irq, uint32_t value, void *param)
+{
+	xon = 1;
+}
+
+void xoff_hook (avr_irq_t *irq, uint32_t value, void *param)
+{
+	xon = 0;
+}
+
+int find_symbol (unsigned long pc)
+{
+	int i;
+
+	for (i=0; i<nsym; ++i)
+		if (pc >= sym[i].addr && pc < sym[i].addr + sym[i].size)
+			return i;
+	return -1;
+}
+
+/*
+ * Execute one instruction and account its cycles.
+ */
+void step (struct phase *ph)
+{
+	avr_cycle_count_t c0 = avr->cycle;
+	int n = find_symbol (avr->pc);
+	int state;
+
+	state = avr_run (avr);
+	if (state == cpu_Done || state == cpu_Crashed) {
+		fprintf (stderr, "simbench: cpu stopped at 0x%x\n", avr->pc);
+		exit (1);
+	}
+	if (! ph)
+		return;
+	ph->total += avr->cycle - c0;
+	if (n < 0 || sym[n].kind != FN_UART)
+		ph->busy += avr->cycle - c0;
+	if (n >= 0 && sym[n].kind == FN_PAGE)
+		ph->page += avr->cycle - c0;
+}
+
+/*
+ * Send a frame, wait for the answer.
+ * Return the answer status, or -1 on timeout.
+ */
+int transact (struct phase *ph, const unsigned char *body, unsigned len,
+	int good)
+{
+	unsigned char hdr [5], cksum = 0;
+	unsigned i, n;
+	avr_cycle_count_t deadline;
+
+	hdr[0] = MESSAGE_START;
+	hdr[1] = seqnum++;
+	hdr[2] = len >> 8;
+	hdr[3] = len;
+	hdr[4] = TOKEN;
+	for (i=0; i<5; ++i)
+		cksum ^= hdr[i];
+	for (i=0; i<len; ++i)
+		cksum ^= body[i];
+	if (! good)
+		cksum = ~cksum;
+
+	answer_len = 0;
+	answer_done = 0;
+	deadline = avr->cycle + TIMEOUT_SEC * khz * 1000;
+	for (n=0; n<len+6; ) {
+		if (xon) {
+			avr_raise_irq (uart_in, n < 5 ? hdr[n] :
+				n < len+5 ? body[n-5] : cksum);
+			n++;
+			continue;
+		}
+		step (ph);
+		if (avr->cycle > deadline)
+			return -1;
+	}
+	ph->bytes += len + 6;
+	while (! answer_done) {
+		step (ph);
+		if (avr->cycle > deadline)
+			return -1;
+	}
+	return answer_len > 6 ? answer[6] : -1;
+}
+
+int command (struct phase *ph, unsigned char c0, unsigned char c1,
+	unsigned char c2)
+{
+	unsigned char body [3] = { c0, c1, c2 };
+
+	return transact (ph, body, 3, 1);
+}
+
+int load_address (struct phase *ph, unsigned long addr)
+{
+	unsigned char body [5];
+
+	addr >>= 1;
+	body[0] = CMD_LOAD_ADDRESS;
+	body[1] = addr >> 24;
+	body[2] = addr >> 16;
+	body[3] = addr >> 8;
+	body[4] = addr;
+	return transact (ph, body, 5, 1);
+}
+
+void load_symbols (const char *filename)
+{
+	FILE *fd;
+	char line [256], type, name [64];
+	unsigned long addr, size;
+
+	fd = fopen (filename, "r");
+	if (! fd) {
+		perror (filename);
+		exit (1);
+	}
+	while (fgets (line, sizeof (line), fd) && nsym < MAXSYM) {
+		if (sscanf (line, "%lx %lx %c %63s", &addr, &size,
+		    &type, name) != 4 || (type != 'T' && type != 't'))
+			continue;
+		strcpy (sym[nsym].name, name);
+		sym[nsym].addr = addr;
+		sym[nsym].size = size;
+		if (strcmp (name, "uart_getchar") == 0 ||
+		    strcmp (name, "uart_putchar") == 0)
+			sym[nsym].kind = FN_UART;
+		else if (strncmp (name, "page_", 5) == 0 ||
+		    strcmp (name, "flash_sync") == 0)
+			sym[nsym].kind = FN_PAGE;
+		nsym++;
+	}
+	fclose (fd);
+}
+
+void usage ()
+{
+	fprintf (stderr, "Usage:\n\tsimbench [-H] -m mcu -f khz -b baud -a baddr [-n pages]\n");
+	fprintf (stderr, "\t\t [-p pagesize] -s symfile image.elf\n");
+	exit (1);
+}
+
+int main (int argc, char **argv)
+{
+	const char *mcu = 0, *symfile = 0;
+	unsigned long baud = 0, baddr = 0, npages = 32, page, i;
+	elf_firmware_t fw;
+	uint32_t flags;
+	struct phase setup = {0}, prog = {0}, read = {0}, parser = {0};
+	unsigned char *image, body [10 + 256];
+	double hz;
+	int ch, errors = 0;
+
+	while ((ch = getopt (argc, argv, "Hm:f:b:a:n:p:s:")) != -1) {
+		switch (ch) {
+		case 'H':
+			printf ("mcu\tkhz\tbaud\trx_cyc_byte\tpage_cyc\t"
+				"read_cyc_byte\tprog_kbs\tread_kbs\n");
+			return 0;
+		case 'm': mcu = optarg; break;
+		case 'f': khz = strtoul (optarg, 0, 0); break;
+		case 'b': baud = strtoul (optarg, 0, 0); break;
+		case 'a': baddr = strtoul (optarg, 0, 0); break;
+		case 'n': npages = strtoul (optarg, 0, 0); break;
+		case 'p': page_bytes = strtoul (optarg, 0, 0); break;
+		case 's': symfile = optarg; break;
+		default: usage ();
+		}
+	}
+	if (optind != argc-1 || ! mcu || ! khz || ! baud || ! baddr ||
+	    ! symfile || page_bytes > 256 || npages * page_bytes > baddr)
+		usage ();
+	load_symbols (symfile);
+
+	memset (&fw, 0, sizeof (fw));
+	if (elf_read_firmware (argv[optind], &fw) != 0) {
+		fprintf (stderr, "%s: cannot read firmware\n", argv[optind]);
+		return 1;
+	}
+	avr = avr_make_mcu_by_name (mcu);
+	if (! avr) {
+		fprintf (stderr, "simbench: unknown mcu %s\n", mcu);
+		return 1;
+	}
+	avr_init (avr);
+	avr->frequency = khz * 1000;
+	avr_load_firmware (avr, &fw);
+	/* Boot reset vector, as with BOOTRST fuse programmed */
+	avr->reset_pc = baddr;
+	avr->pc = baddr;
+
+	/* Scripted host on UART0, without echo to stdout */
+	flags = 0;
+	avr_ioctl (avr, AVR_IOCTL_UART_GET_FLAGS('0'), &flags);
+	flags &= ~AVR_UART_FLAG_STDIO;
+	avr_ioctl (avr, AVR_IOCTL_UART_SET_FLAGS('0'), &flags);
+	uart_in = avr_io_getirq (avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_INPUT);
+	avr_irq_register_notify (avr_io_getirq (avr, AVR_IOCTL_UART_GETIRQ('0'),
+		UART_IRQ_OUTPUT), uart_out_hook, 0);
+	avr_irq_register_notify (avr_io_getirq (avr, AVR_IOCTL_UART_GETIRQ('0'),
+		UART_IRQ_OUT_XON), xon_hook, 0);
+	avr_irq_register_notify (avr_io_getirq (avr, AVR_IOCTL_UART_GETIRQ('0'),
+		UART_IRQ_OUT_XOFF), xoff_hook, 0);
+
+	image = malloc (npages * page_bytes);
+	srand (1);
+	for (i=0; i<npages*page_bytes; ++i)
+		image[i] = rand ();
+
+	/* Wait for sign-on message */
+	while (! signon_done) {
+		step (0);
+		if (avr->cycle > TIMEOUT_SEC * khz * 1000) {
+			fprintf (stderr, "simbench: no sign-on message\n");
+			return 1;
+		}
+	}
+	if (command (&setup, CMD_SIGN_ON, 0, 0) != STATUS_CMD_OK ||
+	    command (&setup, CMD_ENTER_PROGMODE_ISP, 0, 0) != STATUS_CMD_OK ||
+	    command (&setup, CMD_CHIP_ERASE_ISP, 0, 0) != STATUS_CMD_OK) {
+		fprintf (stderr, "simbench: setup failed\n");
+		return 1;
+	}
+
+	/* Program pages */
+	for (page=0; page<npages; ++page) {
+		body[0] = CMD_PROGRAM_FLASH_ISP;
+		body[1] = page_bytes >> 8;
+		body[2] = page_bytes & 0xFF;
+		memset (body + 3, 0, 7);
+		memcpy (body + 10, image + page * page_bytes, page_bytes);
+		if (load_address (&prog, page * page_bytes) != STATUS_CMD_OK ||
+		    transact (&prog, body, 10 + page_bytes, 1) != STATUS_CMD_OK)
+			errors++;
+	}
+	if (command (&prog, CMD_LEAVE_PROGMODE_ISP, 1, 1) != STATUS_CMD_OK)
+		errors++;
+	if (memcmp (avr->flash, image, npages * page_bytes) != 0) {
+		fprintf (stderr, "simbench: flash contents differ\n");
+		errors++;
+	}
+
+	/* Read back */
+	for (page=0; page<npages; ++page) {
+		body[0] = CMD_READ_FLASH_ISP;
+		body[1] = page_bytes >> 8;
+		body[2] = page_bytes & 0xFF;
+		body[3] = 0x20;
+		if (load_address (&read, page * page_bytes) != STATUS_CMD_OK ||
+		    transact (&read, body, 4, 1) != STATUS_CMD_OK ||
+		    answer_len != page_bytes + 9 ||
+		    memcmp (answer + 7, image + page * page_bytes,
+		    page_bytes) != 0)
+			errors++;
+	}
+
+	/* Frames with bad checksum: receive loop only */
+	memset (body, 0x55, sizeof (body));
+	for (page=0; page<npages; ++page)
+		if (transact (&parser, body, 10 + page_bytes, 0) != STATUS_CKSUM_ERROR)
+			errors++;
+
+	if (errors) {
+		fprintf (stderr, "simbench: %d errors\n", errors);
+		return 1;
+	}
+	hz = khz * 1000.0;
+	printf ("%s\t%lu\t%lu\t%.1f\t%.0f\t%.1f\t%.2f\t%.2f\n", mcu, khz, baud,
+		(double) parser.busy / parser.bytes,
+		(double) prog.page / npages,
+		(double) read.busy / (npages * page_bytes),
+		npages * page_bytes / 1024.0 / (prog.total / hz),
+		npages * page_bytes / 1024.0 / (read.total / hz));
+	return 0;
+}
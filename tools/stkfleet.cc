@@ -0,0 +1,656 @@
+/*
+ * Parallel flasher for StkBoot boot loader.
+ * Programs many boards at once through serial ports, from one
+ * event loop with epoll and non-blocking I/O, without a thread
+ * per port. Speaks the subset of STK500 protocol (AVR068),
+ * implemented by stkboot.c, including nonstandard checksum
+ * command CMD_READ_FLASH_ISP|0x80 used for verification.
+ *
+ * Usage:
+ *	stkfleet [-b baud] [-p pagesize] [-V] image.hex port...
+ *
+ * This program is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU General
+ * Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ */
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/epoll.h>
+#include <time.h>
+
+#include "../stk500.h"
+
+#define CMD_CHECKSUM_FLASH_ISP	(CMD_READ_FLASH_ISP | 0x80)
+
+#define RETRIES		3		/* attempts per request */
+#define TIMEOUT_MSEC	1000		/* answer timeout */
+#define ERASE_MSEC	15000		/* chip erase timeout */
+
+/*
+ * One request of programming session, common for all boards.
+ */
+struct request {
+	std::vector<unsigned char> body;
+	int timeout;			/* msec */
+	size_t restart;			/* index to repeat from on error */
+	bool check_crc;			/* answer has checksum */
+	unsigned short crc;		/* expected checksum */
+	unsigned bytes;			/* data bytes programmed */
+};
+
+/*
+ * State of one board.
+ */
+struct board {
+	std::string path;
+	int fd;
+	size_t index;			/* current request */
+	int attempt;
+	unsigned char seqnum;
+	std::vector<unsigned char> tx;	/* frame being sent */
+	size_t txpos;
+	bool want_write;
+	long long deadline;		/* msec */
+	long long started, finished;
+	unsigned bytes;
+
+	/* Answer parser */
+	int state;
+	unsigned char cksum;
+	unsigned char rxseq;
+	unsigned len;
+	std::vector<unsigned char> rx;
+
+	bool done;
+	std::string error;
+};
+
+enum {
+	RX_START, RX_SEQNUM, RX_SIZE1, RX_SIZE2, RX_TOKEN, RX_BODY, RX_CKSUM,
+};
+
+static std::vector<request> session;
+static int epfd;
+
+static long long now_msec ()
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * CRC-16 (x16 + x15 + x2 + 1, reflected), same as crc16() of stkboot.c.
+ */
+static unsigned short crc16 (unsigned short sum, unsigned char byte)
+{
+	int i;
+
+	sum ^= byte;
+	for (i=0; i<8; ++i)
+		sum = (sum & 1) ? (sum >> 1) ^ 0xA001 : sum >> 1;
+	return sum;
+}
+
+static int hexval (const char *p, int n)
+{
+	int v = 0;
+
+	while (n-- > 0) {
+		int c = *p++;
+		v <<= 4;
+		if (c >= '0' && c <= '9')
+			v |= c - '0';
+		else if (c >= 'A' && c <= 'F')
+			v |= c - 'A' + 10;
+		else if (c >= 'a' && c <= 'f')
+			v |= c - 'a' + 10;
+		else
+			return -1;
+	}
+	return v;
+}
+
+/*
+ * Read Intel HEX file, or raw binary when the name ends with .bin.
+ * Unused bytes are 0xFF.
+ */
+static bool read_image (const char *name, std::vector<unsigned char> &mem)
+{
+	FILE *fd;
+	char line [600];
+	unsigned long base = 0;
+	size_t n = strlen (name);
+
+	fd = fopen (name, "rb");
+	if (! fd) {
+		perror (name);
+		return false;
+	}
+	if (n > 4 && strcmp (name + n - 4, ".bin") == 0) {
+		int c;
+		while ((c = getc (fd)) != EOF)
+			mem.push_back (c);
+		fclose (fd);
+		return true;
+	}
+	while (fgets (line, sizeof (line), fd)) {
+		int len, addr, type, i, sum;
+
+		if (line[0] != ':')
+			continue;
+		len = hexval (line+1, 2);
+		addr = hexval (line+3, 4);
+		type = hexval (line+7, 2);
+		if (len < 0 || addr < 0 || type < 0 ||
+		    strlen (line) < (size_t) 11 + len*2)
+			goto bad;
+		sum = len + (addr >> 8) + addr + type;
+		for (i=0; i<=len; ++i) {
+			int b = hexval (line + 9 + i*2, 2);
+			if (b < 0)
+				goto bad;
+			sum += b;
+		}
+		if ((sum & 0xFF) != 0)
+			goto bad;
+		if (type == 0) {
+			unsigned long a = base + addr;
+			if (mem.size() < a + len)
+				mem.resize (a + len, 0xFF);
+			for (i=0; i<len; ++i)
+				mem [a + i] = hexval (line + 9 + i*2, 2);
+		} else if (type == 1) {
+			break;
+		} else if (type == 2) {
+			base = (unsigned long) hexval (line+9, 4) << 4;
+		} else if (type == 4) {
+			base = (unsigned long) hexval (line+9, 4) << 16;
+		}
+	}
+	fclose (fd);
+	return true;
+bad:
+	fprintf (stderr, "%s: bad HEX record: %s", name, line);
+	fclose (fd);
+	return false;
+}
+
+static void add_request (std::vector<unsigned char> body, int timeout,
+	size_t restart)
+{
+	request r;
+
+	r.body = body;
+	r.timeout = timeout;
+	r.restart = restart;
+	r.check_crc = false;
+	r.crc = 0;
+	r.bytes = 0;
+	session.push_back (r);
+}
+
+static void add_load_address (unsigned long addr, size_t restart)
+{
+	/* Word address, high byte first */
+	addr >>= 1;
+	add_request ({ CMD_LOAD_ADDRESS, (unsigned char) (addr >> 24),
+		(unsigned char) (addr >> 16), (unsigned char) (addr >> 8),
+		(unsigned char) addr }, TIMEOUT_MSEC, restart);
+}
+
+/*
+ * Build the list of requests: sign on, erase, program
+ * non-empty pages, verify them by checksum, leave progmode.
+ * On verify error, the page is programmed again.
+ */
+static void build_session (const std::vector<unsigned char> &mem,
+	unsigned pagesize, bool verify)
+{
+	unsigned long addr;
+	unsigned i;
+
+	add_request ({ CMD_SIGN_ON }, TIMEOUT_MSEC, 0);
+	add_request ({ CMD_ENTER_PROGMODE_ISP, 200, 100, 25, 32, 0, 0x53,
+		3, 0xAC, 0x53, 0, 0 }, TIMEOUT_MSEC, 1);
+	add_request ({ CMD_CHIP_ERASE_ISP, 10, 0, 0xAC, 0x80, 0, 0 },
+		ERASE_MSEC, 2);
+
+	for (addr=0; addr<mem.size(); addr+=pagesize) {
+		std::vector<unsigned char> body;
+		size_t restart = session.size();
+
+		for (i=0; i<pagesize; ++i)
+			if (addr + i < mem.size() && mem [addr + i] != 0xFF)
+				break;
+		if (i == pagesize)
+			continue;
+
+		add_load_address (addr, restart);
+		body = { CMD_PROGRAM_FLASH_ISP,
+			(unsigned char) (pagesize >> 8),
+			(unsigned char) pagesize,
+			0xC1, 10, 0x40, 0x4C, 0x20, 0xFF, 0xFF };
+		for (i=0; i<pagesize; ++i)
+			body.push_back (addr + i < mem.size() ?
+				mem [addr + i] : 0xFF);
+		add_request (body, TIMEOUT_MSEC, restart);
+		session.back().bytes = pagesize;
+
+		if (verify) {
+			unsigned short sum = 0;
+
+			add_load_address (addr, restart);
+			for (i=0; i<pagesize; ++i)
+				sum = crc16 (sum, body [10 + i]);
+			add_request ({ CMD_CHECKSUM_FLASH_ISP,
+				(unsigned char) (pagesize >> 8),
+				(unsigned char) pagesize, 0x20 },
+				TIMEOUT_MSEC, restart);
+			session.back().check_crc = true;
+			session.back().crc = sum;
+		}
+	}
+	/* With lazy erase, the pages left unwritten are erased now */
+	add_request ({ CMD_LEAVE_PROGMODE_ISP, 1, 1 }, ERASE_MSEC,
+		session.size());
+}
+
+static speed_t baud_code (int baud)
+{
+	switch (baud) {
+	case 9600:	return B9600;
+	case 19200:	return B19200;
+	case 38400:	return B38400;
+	case 57600:	return B57600;
+	case 115200:	return B115200;
+	case 230400:	return B230400;
+	case 460800:	return B460800;
+	case 921600:	return B921600;
+	}
+	return 0;
+}
+
+static bool open_port (board &b, speed_t speed)
+{
+	struct termios t;
+
+	b.fd = open (b.path.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (b.fd < 0) {
+		b.error = strerror (errno);
+		return false;
+	}
+	if (tcgetattr (b.fd, &t) < 0) {
+		b.error = strerror (errno);
+		return false;
+	}
+	cfmakeraw (&t);
+	t.c_cflag |= CLOCAL | CREAD;
+	t.c_cflag &= ~CRTSCTS;
+	cfsetispeed (&t, speed);
+	cfsetospeed (&t, speed);
+	if (tcsetattr (b.fd, TCSANOW, &t) < 0) {
+		b.error = strerror (errno);
+		return false;
+	}
+	tcflush (b.fd, TCIOFLUSH);
+	return true;
+}
+
+static void finish (board &b, const std::string &error)
+{
+	b.done = true;
+	b.error = error;
+	b.finished = now_msec ();
+	if (b.fd >= 0) {
+		epoll_ctl (epfd, EPOLL_CTL_DEL, b.fd, 0);
+		close (b.fd);
+		b.fd = -1;
+	}
+}
+
+static void set_events (board &b, bool want_write)
+{
+	struct epoll_event ev;
+
+	if (b.want_write == want_write)
+		return;
+	b.want_write = want_write;
+	ev.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+	ev.data.ptr = &b;
+	epoll_ctl (epfd, EPOLL_CTL_MOD, b.fd, &ev);
+}
+
+/*
+ * Send as much of the pending frame as the port accepts.
+ */
+static void flush_tx (board &b)
+{
+	while (b.txpos < b.tx.size()) {
+		ssize_t n = write (b.fd, &b.tx [b.txpos], b.tx.size() - b.txpos);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				break;
+			finish (b, std::string ("write: ") + strerror (errno));
+			return;
+		}
+		b.txpos += n;
+	}
+	set_events (b, b.txpos < b.tx.size());
+}
+
+/*
+ * Build a frame for the current request and start sending it.
+ */
+static void send_request (board &b)
+{
+	const request &r = session [b.index];
+	unsigned char cksum;
+	size_t len = r.body.size();
+
+	b.seqnum++;
+	b.tx = { MESSAGE_START, b.seqnum, (unsigned char) (len >> 8),
+		(unsigned char) len, TOKEN };
+	b.tx.insert (b.tx.end(), r.body.begin(), r.body.end());
+	cksum = 0;
+	for (unsigned char c : b.tx)
+		cksum ^= c;
+	b.tx.push_back (cksum);
+	b.txpos = 0;
+	b.state = RX_START;
+	b.deadline = now_msec () + r.timeout;
+	flush_tx (b);
+}
+
+/*
+ * Request failed: repeat it from the restart point, or give up.
+ */
+static void retry (board &b, const char *reason)
+{
+	if (++b.attempt >= RETRIES) {
+		char buf [80];
+		snprintf (buf, sizeof (buf), "%s at request %zu, command 0x%02x",
+			reason, b.index, session [b.index].body [0]);
+		finish (b, buf);
+		return;
+	}
+	b.index = session [b.index].restart;
+
+	/* Data of repeated requests are counted again */
+	b.bytes = 0;
+	for (size_t i=0; i<b.index; ++i)
+		b.bytes += session [i].bytes;
+	tcflush (b.fd, TCIFLUSH);
+	send_request (b);
+}
+
+/*
+ * Complete answer received.
+ */
+static void process_answer (board &b)
+{
+	const request &r = session [b.index];
+
+	if (b.rxseq != b.seqnum)
+		return;			/* stale answer, ignore */
+	if (b.rx.size() < 2 || b.rx[0] != r.body[0]) {
+		retry (b, "bad answer");
+		return;
+	}
+	if (b.rx[1] != STATUS_CMD_OK) {
+		retry (b, "command failed");
+		return;
+	}
+	if (r.check_crc) {
+		if (b.rx.size() < 4 ||
+		    (b.rx[2] << 8 | b.rx[3]) != r.crc) {
+			retry (b, "verify error");
+			return;
+		}
+	}
+	b.bytes += r.bytes;
+	if (++b.index >= session.size()) {
+		finish (b, "");
+		return;
+	}
+	if (session [b.index].restart == b.index) {
+		/* Next group of requests, repeated together */
+		b.attempt = 0;
+	}
+	send_request (b);
+}
+
+/*
+ * Parse answer frames, same states as the parser of stkboot.c.
+ */
+static void receive (board &b)
+{
+	unsigned char buf [512];
+	ssize_t n, i;
+
+	for (;;) {
+		n = read (b.fd, buf, sizeof (buf));
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return;
+			finish (b, std::string ("read: ") + strerror (errno));
+			return;
+		}
+		if (n == 0)
+			return;
+		for (i=0; i<n && ! b.done; ++i) {
+			unsigned char c = buf [i];
+
+			switch (b.state) {
+			case RX_START:
+				if (c == MESSAGE_START) {
+					b.cksum = c;
+					b.state = RX_SEQNUM;
+				}
+				continue;
+			case RX_SEQNUM:
+				b.rxseq = c;
+				b.state = RX_SIZE1;
+				break;
+			case RX_SIZE1:
+				b.len = c << 8;
+				b.state = RX_SIZE2;
+				break;
+			case RX_SIZE2:
+				b.len |= c;
+				b.state = RX_TOKEN;
+				break;
+			case RX_TOKEN:
+				if (c != TOKEN) {
+					b.state = RX_START;
+					continue;
+				}
+				b.rx.clear();
+				b.state = (b.len > 0) ? RX_BODY : RX_START;
+				break;
+			case RX_BODY:
+				b.rx.push_back (c);
+				if (b.rx.size() == b.len)
+					b.state = RX_CKSUM;
+				break;
+			case RX_CKSUM:
+				b.state = RX_START;
+				if (c != b.cksum) {
+					retry (b, "answer checksum error");
+					continue;
+				}
+				process_answer (b);
+				continue;
+			}
+			b.cksum ^= c;
+		}
+		if (b.done)
+			return;
+	}
+}
+
+static void usage ()
+{
+	fprintf (stderr, "Usage:\n");
+	fprintf (stderr, "\tstkfleet [-b baud] [-p pagesize] [-V] image.hex port...\n");
+	fprintf (stderr, "Options:\n");
+	fprintf (stderr, "\t-b baud\t\tbaud rate, default 115200\n");
+	fprintf (stderr, "\t-p pagesize\tflash page size in bytes, default 256\n");
+	fprintf (stderr, "\t-V\t\tdo not verify\n");
+	exit (1);
+}
+
+int main (int argc, char **argv)
+{
+	std::vector<unsigned char> mem;
+	std::vector<board> boards;
+	int baud = 115200, ch, nfailed;
+	unsigned pagesize = 256;
+	bool verify = true;
+	speed_t speed;
+	size_t active, i;
+	long long t0;
+
+	while ((ch = getopt (argc, argv, "b:p:V")) != -1) {
+		switch (ch) {
+		case 'b':
+			baud = atoi (optarg);
+			break;
+		case 'p':
+			pagesize = atoi (optarg);
+			break;
+		case 'V':
+			verify = false;
+			break;
+		default:
+			usage ();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 2)
+		usage ();
+	speed = baud_code (baud);
+	if (! speed) {
+		fprintf (stderr, "Unsupported baud rate: %d\n", baud);
+		exit (1);
+	}
+	if (pagesize < 2 || pagesize > 256 || (pagesize & (pagesize - 1))) {
+		fprintf (stderr, "Bad page size: %u\n", pagesize);
+		exit (1);
+	}
+	if (! read_image (argv[0], mem))
+		exit (1);
+	build_session (mem, pagesize, verify);
+
+	epfd = epoll_create1 (0);
+	if (epfd < 0) {
+		perror ("epoll_create1");
+		exit (1);
+	}
+
+	/* Addresses of elements must not change after this point. */
+	boards.resize (argc - 1);
+	t0 = now_msec ();
+	active = 0;
+	for (i=0; i<boards.size(); ++i) {
+		board &b = boards [i];
+		struct epoll_event ev;
+
+		b.path = argv [i + 1];
+		b.fd = -1;
+		b.index = 0;
+		b.attempt = 0;
+		b.seqnum = 0;
+		b.txpos = 0;
+		b.want_write = false;
+		b.bytes = 0;
+		b.state = RX_START;
+		b.done = false;
+		b.started = t0;
+		if (! open_port (b, speed)) {
+			finish (b, b.error);
+			continue;
+		}
+		ev.events = EPOLLIN;
+		ev.data.ptr = &b;
+		if (epoll_ctl (epfd, EPOLL_CTL_ADD, b.fd, &ev) < 0) {
+			finish (b, std::string ("epoll: ") + strerror (errno));
+			continue;
+		}
+		active++;
+		send_request (b);
+	}
+
+	while (active > 0) {
+		struct epoll_event events [64];
+		long long now = now_msec (), next = now + 1000;
+		int n, k;
+
+		for (board &b : boards) {
+			if (! b.done && b.deadline < next)
+				next = b.deadline;
+		}
+		n = epoll_wait (epfd, events, 64, next > now ? next - now : 0);
+		if (n < 0 && errno != EINTR) {
+			perror ("epoll_wait");
+			exit (1);
+		}
+		for (k=0; k<n; ++k) {
+			board &b = *(board*) events[k].data.ptr;
+
+			if (b.done)
+				continue;
+			if (events[k].events & EPOLLOUT)
+				flush_tx (b);
+			if (! b.done && (events[k].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+				receive (b);
+		}
+		now = now_msec ();
+		active = 0;
+		for (board &b : boards) {
+			if (b.done)
+				continue;
+			if (now >= b.deadline)
+				retry (b, "timeout");
+			if (! b.done)
+				active++;
+		}
+	}
+
+	/* Report */
+	nfailed = 0;
+	printf ("%-24s %-6s %8s %8s %8s\n", "Port", "Status",
+		"Bytes", "Seconds", "KB/s");
+	for (board &b : boards) {
+		double sec = (b.finished - b.started) / 1000.0;
+
+		printf ("%-24s %-6s %8u %8.2f %8.2f", b.path.c_str(),
+			b.error.empty() ? "ok" : "FAIL", b.bytes, sec,
+			sec > 0 ? b.bytes / 1024.0 / sec : 0.0);
+		if (! b.error.empty()) {
+			printf ("  %s", b.error.c_str());
+			nfailed++;
+		}
+		printf ("\n");
+	}
+	printf ("%zu boards, %d failed, %.2f seconds total\n", boards.size(),
+		nfailed, (now_msec () - t0) / 1000.0);
+	return nfailed ? 2 : 0;
+}